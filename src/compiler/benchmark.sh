@@ -0,0 +1,255 @@
+#!/bin/bash
+
+# Compiles generated scripts of growing size and prints the compiler statistics for each.
+# Usage: ./benchmark.sh [line counts...]
+
+sizes=${@:-1000 2000 5000 10000}
+workdir=$(mktemp -d)
+trap "rm -rf $workdir" EXIT
+
+g++ -O2 -pthread --output $workdir/compiler.o ./compiler.cpp
+if [[ $? != 0 ]]; then
+   echo "Compiled with errors: aborting benchmark!"
+   exit 1
+fi
+
+for lines in $sizes; do
+   script=$workdir/generated$lines.rtos
+   for ((i = 0; i < lines; i++)); do
+      echo "create value$i set (($i + 2) * 3 < 4) && true"
+   done > $script
+
+   echo "== $lines lines ($(wc -c < $script) bytes)"
+   $workdir/compiler.o $script $workdir/generated$lines.rtb --stats | grep -E "^(Verify|Packrat|Optimize|Emit):"
+done
+
+# Loader throughput: a comment-only script keeps tokenizing and parsing cheap
+script=$workdir/comments.rtos
+for ((i = 0; i < 400000; i++)); do
+   echo "# comment line $i of the loader benchmark, long enough to matter"
+done > $script
+
+echo "== loader ($(wc -c < $script) bytes)"
+for option in "" "--no-mmap"; do
+   $workdir/compiler.o $script $workdir/comments.rtb --stats $option | grep -aoE "(Load|Tokenize): .*"
+done
+
+# Tokenizer throughput on identifier- and keyword-heavy code (the variables are never created, so the
+# compilation itself fails after tokenizing)
+script=$workdir/identifiers.rtos
+for ((i = 0; i < 100000; i++)); do
+   echo "set someVariable$i to otherVariable * anotherValue + yetAnotherIdentifier - doubleTrouble"
+   echo "create counter$i: int"
+   echo "        set    counter$i    to    1234567890123456"
+done > $script
+
+echo "== tokenizer ($(wc -c < $script) bytes)"
+for option in "" "--no-simd"; do
+   $workdir/compiler.o $script $workdir/identifiers.rtb --stats $option 2> /dev/null | grep -aoE "Tokenize: .*"
+done
+$workdir/compiler.o $script $workdir/identifiers.rtb --check-tokenizer 2> /dev/null | grep -aoE "Tokenizer check: .*"
+
+# Function-heavy code, compiled on one thread and on a worker pool
+script=$workdir/functions.rtos
+for ((f = 0; f < 300; f++)); do
+   echo "function f$f(a: int, b: int): int"
+   for ((i = 0; i < 30; i++)); do
+      echo "   create v$i set (((a + $i) * 3 < 4) && true)"
+   done
+   echo "   return a"
+   echo "done"
+done > $script
+
+echo "== functions ($(wc -c < $script) bytes, $(nproc) cores)"
+for jobs in 1 2 4; do
+   $workdir/compiler.o $script $workdir/functions.rtb --stats --jobs $jobs | grep -aoE "(Verify|Functions|Emit): .*"
+done
+
+# Compressed bytecode: ratio on the generated scripts and how fast the runtime loads it, inflating included
+g++ -O2 --output $workdir/runtime.o ../runtime/runtime.cpp
+if [[ $? != 0 ]]; then
+   echo "Runtime compiled with errors: skipping the load benchmark!"
+   exit 1
+fi
+
+for name in generated${sizes##* } functions; do
+   echo "== compression ($name)"
+   for option in "" "--varint"; do
+      $workdir/compiler.o $workdir/$name.rtos $workdir/$name.rtb $option > /dev/null
+      $workdir/compiler.o $workdir/$name.rtos $workdir/$name.rtbz $option --compress --stats | grep -aoE "Compress: .*"
+      $workdir/runtime.o $workdir/$name.rtb --stats | grep -aoE "Load: .*"
+      $workdir/runtime.o $workdir/$name.rtbz --stats | grep -aoE "Load: .*"
+   done
+done
+
+# Register code against stack code and typed against generic instructions: static instruction counts of the
+# compiler and the instructions the runtime dispatches for an arithmetic-heavy loop
+script=$workdir/arithmetic.rtos
+cat > $script <<SCRIPT
+create a set 3
+create b set 7
+create total set 0
+for until below 200000 up 1 set i:
+   set total to total + (a * i - b) / 2 + (i - a) * (b + 1)
+done
+exit total
+SCRIPT
+
+echo "== registers and typed instructions (arithmetic loop)"
+for option in "" "--no-typed" "--registers" "--registers --no-typed"; do
+   $workdir/compiler.o $script $workdir/arithmetic.rtb --stats $option | grep -aoE "Emit: .*"
+   $workdir/runtime.o $workdir/arithmetic.rtb --stats | grep -aoE "Run: .*"
+done
+
+# Superinstructions: the sequences the runtime profile finds in a counting loop, then the loop with and without
+# them fused
+script=$workdir/counting.rtos
+cat > $script <<SCRIPT
+create a set 0
+create n set 0
+while a < 1000000:
+   inc a
+   if a == 5:
+      dec n
+   done
+   inc n
+done
+exit n
+SCRIPT
+
+echo "== superinstructions (counting loop)"
+$workdir/compiler.o $script $workdir/counting.rtb --no-fuse > /dev/null
+$workdir/runtime.o $workdir/counting.rtb --profile | grep -aA4 "Profile: bigrams"
+for option in "" "--no-fuse" "--registers" "--registers --no-fuse"; do
+   $workdir/compiler.o $script $workdir/counting.rtb --stats $option | grep -aoE "Emit: .*"
+   $workdir/runtime.o $workdir/counting.rtb --stats | grep -aoE "Run: .*"
+done
+
+# Counted loops: nested for loops with and without loop.i32 and next.i32
+script=$workdir/nested.rtos
+cat > $script <<SCRIPT
+create total set 0
+for until below 1000 up 1 set i:
+   for until below 1000 up 1 set j:
+      inc total
+   done
+done
+exit total
+SCRIPT
+
+echo "== counted loops (nested for loops)"
+for option in "" "--no-fuse" "--registers" "--registers --no-fuse"; do
+   $workdir/compiler.o $script $workdir/nested.rtb --stats $option | grep -aoE "Emit: .*"
+   $workdir/runtime.o $workdir/nested.rtb --stats | grep -aoE "Run: .*"
+done
+
+# Dispatch per opcode: loops around one instruction each, on the runtime with threaded dispatch and on the one
+# with the switch. The loop itself adds a next.i32 to every iteration.
+g++ -O2 -DRTOS_SWITCH_DISPATCH --output $workdir/runtime-switch.o ../runtime/runtime.cpp
+dispatch() {
+   cat > $workdir/dispatch.rtos
+   $workdir/compiler.o $workdir/dispatch.rtos $workdir/dispatch.rtb $2 > /dev/null
+   for runtime in runtime runtime-switch; do
+      echo "$1: $($workdir/$runtime.o $workdir/dispatch.rtb --stats | grep -aoE "Run: .*" | grep -oE "[a-z]+ dispatch, [0-9.]+ ns each")"
+   done
+}
+
+echo "== dispatch per opcode"
+dispatch "push, set" <<SCRIPT
+create a set 1
+create b set 2
+for until below 1000000 up 1 set i:
+   set a to b
+done
+exit a
+SCRIPT
+dispatch "push2, add.i32, set" <<SCRIPT
+create a set 1
+create b set 2
+for until below 1000000 up 1 set i:
+   set a to a + b
+done
+exit a
+SCRIPT
+dispatch "push2, add, set" --no-typed <<SCRIPT
+create a set 1
+create b set 2
+for until below 1000000 up 1 set i:
+   set a to a + b
+done
+exit a
+SCRIPT
+dispatch "push2, mul.f64, set" <<SCRIPT
+create x set 1.5
+create y set 0.999
+for until below 1000000 up 1 set i:
+   set x to x * y
+done
+exit 0
+SCRIPT
+dispatch "add.i32.r" --registers <<SCRIPT
+create a set 1
+create b set 2
+for until below 1000000 up 1 set i:
+   set a to a + b
+done
+exit a
+SCRIPT
+dispatch "invoke, return" <<SCRIPT
+function twice(a: int): int
+   return a + a
+done
+create total set 0
+for until below 300000 up 1 set i:
+   set total to ::twice(i) + 0
+done
+exit total
+SCRIPT
+
+# Entries of 9 instead of 16 bytes: the memory of the stack, and the arithmetic loop plus long and double math on
+# both layouts
+g++ -O2 -DRTOS_COMPACT_ENTRIES --output $workdir/runtime-compact.o ../runtime/runtime.cpp
+script=$workdir/wide.rtos
+cat > $script <<SCRIPT
+create h: long
+set h to 1469598103934665603
+create p: long
+set p to 1099511628211
+create x set 1.5
+create y set 0.999999
+for until below 1000000 up 1 set i:
+   set h to h * p + i
+   set x to x * y + 0.5
+done
+exit 0
+SCRIPT
+
+echo "== compact entries"
+for runtime in runtime runtime-compact; do
+   $workdir/$runtime.o $workdir/arithmetic.rtb --stats | grep -aoE "Stack: .*"
+   for option in "" "--registers"; do
+      for name in arithmetic wide; do
+         $workdir/compiler.o $workdir/$name.rtos $workdir/$name.rtb $option > /dev/null
+         echo "$name $option: $($workdir/$runtime.o $workdir/$name.rtb --stats | grep -aoE "Run: .*")"
+      done
+   done
+done
+
+# The stack is sized by the depths of the function table: a loop needs its frame only, recursion grows segments
+script=$workdir/recursion.rtos
+cat > $script <<SCRIPT
+function sum(n: int): int
+   if n < 1:
+      return 0
+   done
+   return n + ::sum(n - 1) + 0
+done
+create total set ::sum(20000) + 0
+exit 0
+SCRIPT
+
+echo "== stack segments"
+for name in arithmetic recursion; do
+   $workdir/compiler.o $workdir/$name.rtos $workdir/$name.rtb > /dev/null
+   echo "$name: $($workdir/runtime.o $workdir/$name.rtb --stats | grep -aoE "Stack: .*")"
+done
@@ -1,11 +1,32 @@
 #include <cmath>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <algorithm>
 #include <cstring>
 #include <variant>
+#include <unordered_map>
+#include <unordered_set>
+#include <type_traits>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <initializer_list>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <climits>
+#include <cstdint>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -63,38 +84,386 @@ enum class TokenMode {
 };
 
 
+// Tokens point into the source buffer, text is only materialized for literals containing escapes.
+// Blanks, line breaks and comments never become tokens, trivia is their length in front of the token
 struct Token {
    TokenType type;
-   char *text;
+   int offset;
    int length;
+   int trivia;
    int index;
+   string_view text;
+};
+
+// Thrown instead of exiting while errors are deferred (on worker threads), offset -1 marks an error without a source location
+struct CompileError {
+   int offset;
+   int length;
+   const char *text;
 };
 
 /* Keywords */
 
-vector<const char*> keywords {
+constexpr const char* keywords[] {
                   "create", "set", "for", "delete", "if", "inc", "dec", "exit", "done",
                   "up", "down", "below", "above", "invoke", "function", "while", "to", "until", "return" 
 };
 
-vector<const char*> basetypes {
+constexpr const char* basetypes[] {
 		  "bool", "byte", "char", "short", "int", "float", "double", "long", "array", "void"
 };
 
+// Both word lists are placed in a perfect hash table at compile time: the slot of a word is derived from its
+// length, first, second and last character, a collision fails the build
+constexpr int keywordTableSize = 64;
+
+struct KeywordSlot {
+   const char *word;
+   int length;
+   TokenType type;
+};
+
+struct KeywordTable {
+   KeywordSlot slots[keywordTableSize];
+};
+
+constexpr unsigned keywordHash(const char *text, int length) {
+   return (static_cast<unsigned char>(text[0]) * 2 + static_cast<unsigned char>(text[1]) * 12 
+         + static_cast<unsigned char>(text[length - 1]) + length * 7) & (keywordTableSize - 1);
+}
+
+constexpr int keywordLength(const char *word) {
+   int length = 0;
+   while(word[length] != 0) {
+      length++;
+   }
+   return length;
+}
+
+constexpr void keywordInsert(KeywordTable &table, const char *word, TokenType type) {
+   int length = keywordLength(word);
+   KeywordSlot &slot = table.slots[keywordHash(word, length)];
+   if(slot.word != nullptr) {
+      throw "Keyword hash collision: change the factors in keywordHash()";
+   }
+   slot = { word, length, type };
+}
+
+constexpr KeywordTable keywordTableOf() {
+   KeywordTable table = {};
+   for(const char *word : keywords) {
+      keywordInsert(table, word, TokenType::Keyword);
+   }
+   for(const char *word : basetypes) {
+      keywordInsert(table, word, TokenType::BaseType);
+   }
+   return table;
+}
+
+constexpr KeywordTable keywordTable = keywordTableOf();
+
+/* Character classes */
+
+// One byte of class flags per character, built at compile time from the same ranges the tokenizer always used
+constexpr uint8_t classUpper = 1;
+constexpr uint8_t classLower = 2;
+constexpr uint8_t classDigit = 4;
+constexpr uint8_t classIdentifier = 8;
+constexpr uint8_t classWhitespace = 16;
+
+struct CharacterTable {
+   uint8_t classes[256];
+};
+
+constexpr CharacterTable characterTableOf() {
+   CharacterTable table = {};
+   for(int i = 0; i < 256; i++) {
+      char c = static_cast<char>(i);
+      uint8_t flags = 0;
+      if((c > 191 && c < 223) || (c >= 'A' && c <= 'Z')) flags |= classUpper;
+      if((c > 221 && c < 256) || (c >= 'a' && c <= 'z')) flags |= classLower;
+      if(c >= '0' && c <= '9') flags |= classDigit;
+      if(flags != 0 || c == '$') flags |= classIdentifier;
+      if(c == ' ' || c == '\t') flags |= classWhitespace;
+      table.classes[i] = flags;
+   }
+   return table;
+}
+
+constexpr CharacterTable characterTable = characterTableOf();
+
+// Runs of whitespace, identifier and digit characters are scanned 32 (AVX2) or 16 (SSE2) bytes at a time, the
+// vector compares treat bytes above 127 as negative and so only agree with the table where char is signed
+#if !defined(RTOS_SCALAR_TOKENIZER) && CHAR_MIN < 0 && (defined(__SSE2__) || defined(__AVX2__))
+#define TOKENIZER_SIMD 1
+#else
+#define TOKENIZER_SIMD 0
+#endif
+
 /* Util Functions */
 
-int arrayFind(vector<const char*> *vec, char* text, int length);
+TokenType findKeyword(const char *text, int length);
 char* charcpy(const char *src, int length);
-std::string readFile(const char *file);
-void writeFile(const char *src, const char *file);
-int hextoint(char *text, int offset, int length);
+char* readFile(const char *file, int *length);
+const char* mapFile(const char *file, int *length);
+void unmapFile(const char *content, int length);
+void writeFile(const char *data, size_t length, const char *file);
+vector<char> compressBytecode(const vector<char> &plain);
+int hextoint(const char *text, int offset, int length);
+void compilerError(const char *text);
+
+/* Trace */
+
+// Build with -DTRACE_LEVEL=n to get the compiler's trace output, level 0 compiles every call site out.
+//   1: compiler phases, source and tokens
+//   2: statements and nodes attempted by the parser
+//   3: every single token attempt
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 0
+#endif
+
+#define TRACE(level, message) do { if constexpr (TRACE_LEVEL >= (level)) { traceSink << message << '\n'; } } while(0)
+
+ostream &traceSink = cout;
+
+/* Arena */
+
+// Owns the memory of one compilation (parser nodes, results, token text), which is released in one step
+class Arena {
+   public:
+      Arena(size_t blockSize = 64 * 1024) {
+         this->blockSize = blockSize;
+         this->position = nullptr;
+         this->end = nullptr;
+         this->allocations = 0;
+         this->bytes = 0;
+         this->peakBlocks = 0;
+      }
+
+      ~Arena() {
+         this->release();
+      }
+
+      void* allocate(size_t size, size_t alignment = alignof(max_align_t)) {
+         this->allocations++;
+         this->bytes += size;
+
+         uintptr_t aligned = (reinterpret_cast<uintptr_t>(this->position) + alignment - 1) & ~(alignment - 1);
+         if(this->position == nullptr || aligned + size > reinterpret_cast<uintptr_t>(this->end)) {
+            size_t required = size + alignment;
+            this->grow(required > this->blockSize / 4 ? required : this->blockSize);
+            aligned = (reinterpret_cast<uintptr_t>(this->position) + alignment - 1) & ~(alignment - 1);
+         }
+
+         this->position = reinterpret_cast<char*>(aligned + size);
+         return reinterpret_cast<void*>(aligned);
+      }
+
+      template<typename T, typename... Args>
+      T* make(Args&&... args) {
+         T *object = new (this->allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+         if constexpr (!is_trivially_destructible<T>::value) {
+            this->destructors.push_back({ object, [](void *target) { static_cast<T*>(target)->~T(); } });
+         }
+         return object;
+      }
+
+      void release() {
+         this->rewind({ 0, 0, nullptr, nullptr });
+      }
+
+      // A position in the arena, everything allocated after it can be given back with rewind()
+      struct Mark {
+         size_t blocks;
+         size_t destructors;
+         char *position;
+         char *end;
+      };
+
+      Mark mark() {
+         return { this->blocks.size(), this->destructors.size(), this->position, this->end };
+      }
+
+      void rewind(Mark mark) {
+         while(this->destructors.size() > mark.destructors) {
+            Destructor &destructor = this->destructors.back();
+            destructor.destroy(destructor.object);
+            this->destructors.pop_back();
+         }
+         while(this->blocks.size() > mark.blocks) {
+            free(this->blocks.back());
+            this->blocks.pop_back();
+         }
+         this->position = mark.position;
+         this->end = mark.end;
+      }
+
+      long getAllocations() {
+         return this->allocations;
+      }
+
+      long getBytes() {
+         return this->bytes;
+      }
+
+      int getBlockCount() {
+         return this->blocks.size();
+      }
+
+      int getPeakBlockCount() {
+         return this->peakBlocks;
+      }
+
+   private:
+      struct Destructor {
+         void *object;
+         void (*destroy)(void*);
+      };
+
+      void grow(size_t size) {
+         char *block = static_cast<char*>(malloc(size));
+         if(block == nullptr) {
+            cerr << "Compiler error: Out of memory!" << endl;
+            exit(1);
+         }
+         this->blocks.push_back(block);
+         this->peakBlocks = max(this->peakBlocks, (int) this->blocks.size());
+         this->position = block;
+         this->end = block + size;
+      }
+
+      vector<char*> blocks;
+      vector<Destructor> destructors;
+      char *position;
+      char *end;
+      size_t blockSize;
+      long allocations;
+      long bytes;
+      int peakBlocks;
+};
+
+thread_local Arena *arena;
+Arena *textArena; // escaped literal text, outlives the statement arena while tokens are streamed
+
+/* Token stream */
+
+// Produces the tokens of a source one at a time, tokenize() drains it into a vector
+class Tokenizer {
+   public:
+      Tokenizer(const char *text, int length) {
+         this->text = text;
+         this->length = length;
+         this->index = 0;
+         this->end = 0;
+         this->produced = 0;
+         this->last = TokenType::NewLine;
+         this->finished = false;
+      }
+
+      // Appends the next token to tokens, the last one is EoF, returns false once the source is exhausted
+      bool next(vector<Token> *tokens);
+
+      bool isFinished() {
+         return this->finished;
+      }
+
+   private:
+      const char *text;
+      int length;
+      int index;
+      int end;
+      int produced;
+      TokenType last;
+      bool finished;
+};
+
+// Lookahead window over a Tokenizer: at() pulls tokens on demand into a ring buffer, release() drops the
+// tokens in front of an index. The ring only grows when a single statement needs more tokens than it holds
+class TokenStream {
+   public:
+      TokenStream(const char *text, int length) : tokenizer(text, length) {
+         this->ring.resize(64);
+         this->mask = 63;
+         this->first = 0;
+         this->count = 0;
+      }
+
+      Token& at(int index) {
+         while(index >= this->count && !this->tokenizer.isFinished()) {
+            this->pull();
+         }
+         if(index >= this->count) {
+            index = this->count - 1;
+         }
+         if(index < this->first) {
+            cerr << "Compiler error: Token " << index << " was already released from the token stream!" << endl;
+            exit(1);
+         }
+         return this->ring[index & this->mask];
+      }
+
+      // Tokenizes the whole source up front
+      void fill() {
+         while(!this->tokenizer.isFinished()) {
+            this->pull();
+         }
+      }
+
+      void release(int index);
+
+      // Tokens pulled from the tokenizer so far
+      int size() {
+         return this->count;
+      }
+
+      int getCapacity() {
+         return this->ring.size();
+      }
+
+   private:
+      void pull() {
+         this->pending.clear();
+         if(!this->tokenizer.next(&(this->pending))) {
+            return;
+         }
+         if(this->count - this->first == (int) this->ring.size()) {
+            this->grow();
+         }
+         this->ring[this->count & this->mask] = this->pending.back();
+         this->count++;
+      }
+
+      void grow() {
+         vector<Token> larger(this->ring.size() * 2);
+         int largerMask = larger.size() - 1;
+         for(int i = this->first; i < this->count; i++) {
+            larger[i & largerMask] = this->ring[i & this->mask];
+         }
+         this->ring.swap(larger);
+         this->mask = largerMask;
+      }
+
+      Tokenizer tokenizer;
+      vector<Token> ring;
+      vector<Token> pending;
+      int mask;
+      int first;
+      int count;
+};
 
 /* Classes */
 
 class TokenNode {
 public:
+   static void* operator new(size_t size) {
+      return arena->allocate(size, alignof(TokenNode));
+   }
+
+   static void operator delete(void *node) {
+   }
+
    TokenNode(initializer_list<variant<TokenNode*, TokenType, const char*>> nodes, TokenMode mode = TokenMode::ONCE) {
-      this->list = new vector<variant<TokenNode*, TokenType, const char*>>();
+      this->list = arena->make<vector<variant<TokenNode*, TokenType, const char*>>>();
       for (const variant<TokenNode*, TokenType, const char*>& node : nodes) {
             this->list->push_back(node);
       }
@@ -142,6 +511,8 @@ private:
    vector<variant<TokenNode*, TokenType, const char*>> *list;
 };
 
+static_assert(is_trivially_destructible<TokenNode>::value, "TokenNode is released with the arena without running its destructor");
+
 
 class TokenResult {
    public:
@@ -151,7 +522,9 @@ class TokenResult {
 	 this->tokens = {};
 
 	 this->message = charcpy("", 0);
-	 this->skipped = 0;
+	 this->tokenCount = 0;
+	 this->matchedCount = 0;
+	 this->eof_ = false;
       }
 
       bool isEmpty() {
@@ -175,16 +548,7 @@ class TokenResult {
       }
 
       int getTokenCount() {
-         int count = 0;
-	 for(variant<TokenResult*, Token>& v : this->tokens) {
-            if(holds_alternative<TokenResult*>(v)) {
-               TokenResult *result = get<TokenResult*>(v);
-	       count += result->getTokenCount();
-	    } else {
-               count++;
-	    }  
-	 }
-	 return count + this->skipped;
+         return this->tokenCount;
       }
 
       vector<variant<TokenResult*, Token>>* getTokens() {
@@ -192,8 +556,22 @@ class TokenResult {
       }
 
       void add(variant<TokenResult*, Token> element) {
+         this->count(element, 1);
          this->tokens.push_back(element);
       }
+
+      // Adds a result verified on another thread, unify may already have consumed it, so its count is passed along
+      void addVerified(TokenResult *result, int tokenCount) {
+         this->tokens.push_back(result);
+         this->tokenCount += tokenCount;
+         this->matchedCount += tokenCount;
+      }
+
+      void clear() {
+         this->tokens.clear();
+         this->tokenCount = 0;
+         this->matchedCount = 0;
+      }
    
       void setMessage(char *message) {
 	 this->message = message;
@@ -207,31 +585,8 @@ class TokenResult {
 	 return strlen(this->message) > 0;
       }
 
-      void skip() {
-	 (this->skipped)++;
-      }
-
-      void incSkipped(int skipped) {
-	 this->skipped += skipped;
-      }
-
-      int getSkipped() {
-	 return this->skipped;
-      }
-
       int getMatchedTokens() {
-         int count = 0;
-	 for(variant<TokenResult*, Token>& v : this->tokens) {
-            if(holds_alternative<TokenResult*>(v)) {
-               TokenResult *result = get<TokenResult*>(v);
-	       if(result->isSatisfied()) {
-	          count += result->getTokenCount();   
-	       }
-	    } else {
-               count++;
-	    }  
-	 }
-	 return count;
+         return this->matchedCount;
       }
 
       Token* getFirstToken() {
@@ -240,22 +595,22 @@ class TokenResult {
 
       Token popToken() {
          if(!holds_alternative<Token>(this->tokens.at(0))) {
-            cerr << "Attempted token pop, but found result!" << endl;
-            exit(1);
+            compilerError("Attempted token pop, but found result!");
          }
          
          Token token = get<Token>(this->tokens.at(0));
+         this->count(this->tokens.at(0), -1);
          this->tokens.erase(this->tokens.begin());
          return token;
       }
       
       TokenResult* popResult() {
          if(!holds_alternative<TokenResult*>(this->tokens.at(0))) {
-            cerr << "Attempted result pop, but found token!" << endl;
-            exit(1);
+            compilerError("Attempted result pop, but found token!");
          }
          
          TokenResult *result = get<TokenResult*>(this->tokens.at(0));
+         this->count(this->tokens.at(0), -1);
          this->tokens.erase(this->tokens.begin());
          return result;
       }
@@ -280,6 +635,21 @@ class TokenResult {
       }
 
    private:
+      // Keeps the counts current as elements come and go, so reading them never walks the subtree
+      void count(variant<TokenResult*, Token>& element, int sign) {
+         if(holds_alternative<TokenResult*>(element)) {
+            TokenResult *result = get<TokenResult*>(element);
+            int count = result->getTokenCount();
+            this->tokenCount += sign * count;
+            if(result->isSatisfied()) {
+               this->matchedCount += sign * count;
+            }
+         } else {
+            this->tokenCount += sign;
+            this->matchedCount += sign;
+         }
+      }
+
       Token* getFirstForResult(TokenResult *result) {
          for(variant<TokenResult*, Token>& v : *(result->getTokens())) {
             if(holds_alternative<Token>(v)) {
@@ -300,7 +670,8 @@ class TokenResult {
       char *message;
       TokenNode *node;
       bool satisfied;
-      int skipped;
+      int tokenCount;
+      int matchedCount;
       bool eof_;
       vector<variant<TokenResult*, Token>> tokens;
 };
@@ -311,7 +682,8 @@ enum class PointerType {
    STACK_VALUE,
    CONSTANT,
    FUNCTION,
-   MEMORY
+   MEMORY,
+   IMMEDIATE
 };
 
 enum class BaseType {
@@ -323,7 +695,8 @@ enum class BaseType {
    Float,
    Double,
    Long,
-   Void
+   Void,
+   Array
 };
 
 enum class Operator {
@@ -339,6 +712,29 @@ enum class Operator {
    Smaller
 };
 
+// Type byte of constants and created variables in the bytecode, the base types keep their numbers
+enum class TypeCode : uint8_t {
+   Bool,
+   Byte,
+   Char,
+   Short,
+   Int,
+   Float,
+   Double,
+   Long,
+   Void,
+   Array,
+   String,
+   Function,
+   Object
+};
+
+// A literal as it is stored in the constants table, data is little endian
+struct Constant {
+   TypeCode type;
+   string data;
+};
+
 class Type {
    public:
       Type(variant<BaseType, const char*> type) {
@@ -371,10 +767,7 @@ class Variable {
    
    public:
       Variable(PointerType pointerType, Type type, const char* identifier = nullptr, long value = 0)
-      : pointerType(pointerType), type(type), value(value) {
-         if (identifier != nullptr) {
-            identifier = charcpy(identifier, strlen(identifier));
-         }
+      : pointerType(pointerType), identifier(identifier), value(value), type(type) {
       }
 
       PointerType getPointerType() {
@@ -403,7 +796,7 @@ class Variable {
 
    private:
       PointerType pointerType;
-      char *identifier;
+      const char *identifier;
       long value;
       Type type;
 };
@@ -413,7 +806,9 @@ enum class OperandType {
    InvokeChain,
    Primitive,
    Identifier,
-   Block
+   Block,
+   Function,
+   Array
 };
 
 
@@ -466,14 +861,38 @@ class Value {
    public:
       Value(OperandType type) {
          this->operandType = type;
+         this->offset = -1;
+         this->length = 0;
       }
 
       OperandType getOperandType() {
          return this->operandType;
       }
 
+      // Remembers where the value starts in the source, for errors found after parsing
+      void locate(Token *token) {
+         this->offset = token->offset;
+         this->length = token->length;
+      }
+
+      // For values the compiler makes up, they are located where the value they replace was
+      void locate(Value *value) {
+         this->offset = value->offset;
+         this->length = value->length;
+      }
+
+      int getOffset() {
+         return this->offset;
+      }
+
+      int getLength() {
+         return this->length;
+      }
+
    private:
       OperandType operandType;
+      int offset;
+      int length;
 };
 
 class Operation {
@@ -548,6 +967,10 @@ class ValueInvoke : public Value {
          this->parameters->push_back(value);
       }
 
+      vector<Value*>* getParameters() {
+         return this->parameters;
+      }
+
       ValueIdentifier getSpace() {
 	 return this->space;
       }
@@ -567,22 +990,69 @@ class ValueInvokeChain : public Value {
          this->chain = new vector<ValueInvoke*>();
       }
 
+      void add(ValueInvoke *invoke) {
+         this->chain->push_back(invoke);
+      }
+
+      vector<ValueInvoke*>* getChain() {
+         return this->chain;
+      }
+
    private:
       vector<ValueInvoke*>* chain;
 };
 
 class ValuePrimitive : public Value {
    public:
-      ValuePrimitive(Type type) 
-	      : Value(OperandType::Primitive), type(type) {
+      ValuePrimitive(Type type, Constant constant) 
+	      : Value(OperandType::Primitive), type(type), constant(constant) {
       }
 
       Type getType() {
 	 return this->type;
       }
 
+      Constant* getConstant() {
+	 return &(this->constant);
+      }
+
    private:
       Type type;
+      Constant constant;
+};
+
+class SFunction;
+
+class ValueFunction : public Value {
+   public:
+      ValueFunction(SFunction *function) : Value(OperandType::Function) {
+         this->function = function;
+      }
+
+      SFunction* getFunction() {
+         return this->function;
+      }
+
+   private:
+      SFunction *function;
+};
+
+class ValueArray : public Value {
+   public:
+      ValueArray() : Value(OperandType::Array) {
+         this->elements = new vector<Value*>();
+      }
+
+      void addElement(Value *value) {
+         this->elements->push_back(value);
+      }
+
+      vector<Value*>* getElements() {
+         return this->elements;
+      }
+
+   private:
+      vector<Value*> *elements;
 };
 
 class UnwrappedOperation {
@@ -597,6 +1067,8 @@ class Statement {
       Statement(const char *name) {
          this->name = name;
 	 this->statements = new vector<Statement*>();
+         this->offset = -1;
+         this->length = 0;
       }
 
       const char* getName() {
@@ -611,15 +1083,31 @@ class Statement {
 	 this->statements->push_back(statement);
       }
 
+      // Remembers where the statement starts in the source, for errors found after parsing
+      void locate(Token *token) {
+         this->offset = token->offset;
+         this->length = token->length;
+      }
+
+      int getOffset() {
+         return this->offset;
+      }
+
+      int getLength() {
+         return this->length;
+      }
+
    private:
       const char *name;
       vector<Statement*> *statements;
+      int offset;
+      int length;
 };
 
 class SFunction : public Statement {
    public: 
-      SFunction() 
-	      : Statement("function"), parameters(new vector<Variable>()) {
+      SFunction(const char *identifier, Type *returnType) 
+	      : Statement("function"), identifier(identifier), returnType(returnType), parameters(new vector<Variable>()) {
       }
 
       void addParameter(Variable *variable) {
@@ -629,105 +1117,749 @@ class SFunction : public Statement {
       vector<Variable>* getParameters() {
 	 return this->parameters;
       }
+
+      // Empty for lambdas and the top level code
+      const char* getIdentifier() {
+	 return this->identifier;
+      }
+
+      Type* getReturnType() {
+	 return this->returnType;
+      }
   
    private:
-      const char *name;
+      const char *identifier;
+      Type *returnType;
       vector<Variable> *parameters;
 };
 
 class SCreate : public Statement {
    public: 
-      SCreate(const char *identifier, Type type) 
-	      : Statement("create"), identifier(identifier), type(type) {
+      SCreate(const char *identifier, Type *type, Value *value) 
+	      : Statement("create"), identifier(identifier), type(type), value(value) {
       }
 
       const char* getIdentifier() {
 	 return this->identifier;
       }
 
-      Type getType() {
+      // Either the type or the initial value is given
+      Type* getType() {
 	 return this->type;
       }
+
+      Value* getValue() {
+	 return this->value;
+      }
+
+      void setValue(Value *value) {
+	 this->value = value;
+      }
    private:
       const char *identifier;
-      Type type;
+      Type *type;
+      Value *value;
 };
 
-class SDelete : public Statement {
+class SSet : public Statement {
    public:
-      SDelete(const char *identifer) : Statement("delete") {
+      SSet(const char *identifier, Value *value) : Statement("set") {
          this->identifier = identifier;
+         this->value = value;
       }
 
       const char* getIdentifier() {
 	 return this->identifier;
       }
 
+      Value* getValue() {
+	 return this->value;
+      }
+
+      void setValue(Value *value) {
+	 this->value = value;
+      }
+
    private:
       const char *identifier;
+      Value *value;
 };
 
-Token endOfFileToken;
-vector<TokenNode> *ast;
-TokenNode *contextNode;
+class SDelete : public Statement {
+   public:
+      SDelete(const char *identifier) : Statement("delete") {
+         this->identifier = identifier;
+      }
 
-SFunction *functions;
-int functionsCounter;
+      const char* getIdentifier() {
+	 return this->identifier;
+      }
 
-Variable *constants;
-int constantsCounter;
+   private:
+      const char *identifier;
+};
 
-/* Functions */
+// increment and decrement
+class SStep : public Statement {
+   public:
+      SStep(const char *name, const char *identifier) : Statement(name) {
+         this->identifier = identifier;
+      }
 
-// TOKENIZER (LEVEL 1)
+      const char* getIdentifier() {
+	 return this->identifier;
+      }
 
-vector<Token> tokenize(char *text, int length);
-
-Token nextToken(char *text, int length);
-Token nextKeywordToken(char *text, int length);
-Token nextIdentifierToken(char *text, int length);
-Token nextSpecialToken(char *text, int length);
-void evaluateToken(char* text, int *index, vector<Token> *tokens, int length, TokenType *last);
-void evaluateNumber(char* text, int *index, vector<Token> *tokens, int length);
-void evaluateComment(char* text, int *index, vector<Token> *tokens, int length);
-void evaluateString(char* text, int *index, vector<Token> *tokens, int length);
-void evaluateChar(char* text, int *index, vector<Token> *tokens, int length);
-char* evaluateUnicode(char* text, int *index, vector<Token> *tokens,  int length);
-int byEscapedCharacter(char c);
+   private:
+      const char *identifier;
+};
 
-// PARSER (LEVEL 2)
+// exit and return
+class SResult : public Statement {
+   public:
+      SResult(const char *name, Value *value) : Statement(name) {
+         this->value = value;
+      }
 
-void initStatements();
-TokenResult* verify(vector<Token> *tokens);
-TokenResult* verifyContext(TokenNode *node, vector<Token> *list, int index);
-TokenResult* verifyEachVariant(TokenNode *node, vector<Token> *tokens, int index);
-TokenResult* verifyVariant(variant<TokenNode*, TokenType, const char*> *variant, vector<Token> *tokens, int index);
-TokenResult* verifyNode(TokenNode *node, vector<Token> *tokens, int index);
-TokenResult* verifyBranch(TokenNode *node, vector<Token> *tokens, int index);
-TokenResult* verifyMoreOrNone(TokenNode *node, vector<Token> *tokens, int index);
-TokenResult* verifyOnceOrMore(TokenNode *node, vector<Token> *tokens, int index);
-TokenResult* verifyOnceOrNone(TokenNode *node, vector<Token> *tokens, int index);
-TokenResult* verifyOnce(TokenNode *node, vector<Token> *tokens, int index);
-void verifyError(vector<Token> *tokens, int index);
-void verifyError(vector<Token> *tokens, int index, const char *text);
+      Value* getValue() {
+	 return this->value;
+      }
 
-// UNIFY (LEVEL 3)
+      void setValue(Value *value) {
+	 this->value = value;
+      }
 
-Statement* unify(Statement* container, TokenResult *context);
-Statement* unifyStatement(TokenResult *statement);
-Statement* unifyCreate(TokenResult *statement);
-Statement* unifyDelete(TokenResult *statement);
-Statement* unifySet(TokenResult *statement);
+   private:
+      Value *value;
+};
+
+class SInvoke : public Statement {
+   public:
+      SInvoke(ValueInvokeChain *chain) : Statement("invoke") {
+         this->chain = chain;
+      }
+
+      ValueInvokeChain* getChain() {
+	 return this->chain;
+      }
+
+   private:
+      ValueInvokeChain *chain;
+};
+
+// if and while, the statements are the body
+class SCondition : public Statement {
+   public:
+      SCondition(const char *name, Value *condition) : Statement(name) {
+         this->condition = condition;
+         this->otherwise = nullptr;
+      }
+
+      Value* getCondition() {
+	 return this->condition;
+      }
+
+      void setCondition(Value *condition) {
+	 this->condition = condition;
+      }
+
+      // The following else if (another SCondition) or else (a plain statement holding the body)
+      Statement* getOtherwise() {
+	 return this->otherwise;
+      }
+
+      void setOtherwise(Statement *otherwise) {
+	 this->otherwise = otherwise;
+      }
+
+   private:
+      Value *condition;
+      Statement *otherwise;
+};
+
+// Counts from zero by step while the counter is below (counting up) or above (counting down) the limit
+class SFor : public Statement {
+   public:
+      SFor(Value *limit, Value *step, bool down, bool above, const char *counter) : Statement("for") {
+         this->limit = limit;
+         this->step = step;
+         this->down = down;
+         this->above = above;
+         this->counter = counter;
+      }
+
+      Value* getLimit() {
+	 return this->limit;
+      }
+
+      void setLimit(Value *limit) {
+	 this->limit = limit;
+      }
+
+      Value* getStep() {
+	 return this->step;
+      }
+
+      void setStep(Value *step) {
+	 this->step = step;
+      }
+
+      bool isDown() {
+	 return this->down;
+      }
+
+      bool isAbove() {
+	 return this->above;
+      }
+
+      // nullptr if the loop doesn't name its counter
+      const char* getCounter() {
+	 return this->counter;
+      }
+
+   private:
+      Value *limit;
+      Value *step;
+      bool down;
+      bool above;
+      const char *counter;
+};
+
+Token endOfFileToken;
+const int sourcePadding = 128;
+vector<TokenNode> *ast;
+TokenNode *contextNode;
+
+/* Packrat */
+
+struct PackratKey {
+   TokenNode *node;
+   int index;
+
+   bool operator==(const PackratKey &other) const {
+      return this->node == other.node && this->index == other.index;
+   }
+};
+
+struct PackratKeyHash {
+   size_t operator()(const PackratKey &key) const {
+      return hash<TokenNode*>()(key.node) ^ (static_cast<size_t>(key.index) * 0x9E3779B97F4A7C15ull);
+   }
+};
+
+thread_local unordered_map<PackratKey, TokenResult*, PackratKeyHash> packratMemo;
+thread_local long packratHits;
+thread_local long packratMisses;
+
+bool printStats = false;
+bool useMmap = true;
+bool useSimd = true;
+bool checkTokenizer = false;
+bool streamStatements = false;
+bool optimizeProgram = true;
+bool useVarints = false;
+bool useCompression = false;
+bool useRegisters = false;
+bool useTypedOpcodes = true;
+bool useSuperinstructions = true;
+int jobCount = 1;
+
+// Set when statements are streamed: every top level statement is handed to it as soon as it is verified
+Statement* (*statementSink)(TokenResult *statement) = nullptr;
+
+thread_local bool deferErrors = false;
+
+/* Function pool */
+
+// A top level function, verified and unified on a worker thread
+struct FunctionJob {
+   int start;
+   int tokenCount;
+   TokenResult *result;
+   Statement *statement;
+   bool failed;
+   bool failedInUnify;
+   CompileError error;
+   promise<void> done;
+   future<void> finished;
+};
+
+// Top level functions don't depend on each other's bodies, so they are compiled on worker threads while the
+// main thread parses the rest of the file. Each worker has its own arena and packrat memo, the arenas are kept
+// until the compilation ends. The main thread takes the results in source order, errors included.
+class FunctionPool {
+   public:
+      FunctionPool(TokenStream *tokens, int workerCount);
+
+      ~FunctionPool() {
+         this->wait();
+      }
+
+      // Waits for the workers, they finish once every function was compiled
+      void wait() {
+         for(thread &worker : this->workers) {
+            if(worker.joinable()) {
+               worker.join();
+            }
+         }
+      }
+
+      // Waits for the function starting at the token index, nullptr if no function was found there
+      FunctionJob* take(int index);
+
+      // The job that produced the given statement result
+      FunctionJob* byResult(TokenResult *result) {
+         auto job = this->results.find(result);
+         return job != this->results.end() ? job->second : nullptr;
+      }
+
+      int getFunctionCount() {
+         return this->jobs.size();
+      }
+
+      int getWorkerCount() {
+         return this->workers.size();
+      }
+
+      long getHits() {
+         return this->hits;
+      }
+
+      long getMisses() {
+         return this->misses;
+      }
+
+   private:
+      void work(int worker);
+
+      TokenStream *tokens;
+      TokenNode *functionNode;
+      vector<unique_ptr<FunctionJob>> jobs;
+      vector<unique_ptr<Arena>> arenas;
+      vector<thread> workers;
+      unordered_map<TokenResult*, FunctionJob*> results;
+      atomic<size_t> nextJob;
+      atomic<long> hits;
+      atomic<long> misses;
+      size_t taken;
+};
+
+FunctionPool *functionPool = nullptr;
+
+/* Names */
+
+// Identifiers outlive the arenas (the statements are kept until the bytecode is written), each name is stored
+// once, so names can be compared by their pointer
+class NamePool {
+   public:
+      const char* intern(string_view name) {
+         lock_guard<mutex> guard(this->lock);
+         return this->names.emplace(name).first->c_str();
+      }
+
+   private:
+      mutex lock;
+      unordered_set<string> names;
+};
+
+NamePool names;
+SFunction *program; // the top level code, function 0 of the bytecode
+
+/* Optimizer */
+
+// Runs between unify and emit: operations on literals are computed at compile time, branches that can't be taken
+// and statements after exit and return are dropped. Named functions in dropped code are kept, they are called by name.
+class Optimizer {
+   public:
+      Optimizer() {
+         this->folded = 0;
+         this->decided = 0;
+         this->removed = 0;
+      }
+
+      // Optimizes the statements of the function and of every function in it
+      void optimize(SFunction *function);
+
+      int getFoldedCount() {
+         return this->folded;
+      }
+
+      // Conditions of if and while that are known at compile time
+      int getDecidedCount() {
+         return this->decided;
+      }
+
+      int getRemovedCount() {
+         return this->removed;
+      }
+
+   private:
+      void optimizeBlock(vector<Statement*> *statements);
+      void optimizeStatement(Statement *statement, vector<Statement*> *result);
+      Statement* optimizeCondition(SCondition *condition, vector<Statement*> *result);
+      Statement* toBlock(Statement *statement);
+      void drop(Statement *statement, vector<Statement*> *result);
+
+      Value* fold(Value *value);
+      Value* foldBlock(ValueBlock *block);
+      Value* foldOperator(Operator op, Value *first, Value *second, Value *location);
+      Value* foldNot(Value *value, Value *location);
+      Value* compute(Operator op, Constant *first, Constant *second);
+      bool isBool(Value *value, bool expected);
+
+      int folded;
+      int decided;
+      int removed;
+};
+
+/* Emitter */
+
+// Instructions of the stack machine, see instructions.txt
+enum class Opcode : uint8_t {
+   Exit,
+   Push,
+   Pop,
+   Create,
+   Delete,
+   Set,
+   Add,
+   Sub,
+   Mul,
+   Div,
+   Equal,
+   Smaller,
+   Greater,
+   And,
+   Or,
+   Not,
+   Jump,
+   JumpUnless,
+   Invoke,
+   Return,
+   End,
+   Array,
+   // register variant: three address code on the slots of the frame
+   Move,
+   AddRegister,
+   SubRegister,
+   MulRegister,
+   DivRegister,
+   EqualRegister,
+   SmallerRegister,
+   GreaterRegister,
+   AndRegister,
+   OrRegister,
+   NotRegister,
+   JumpUnlessRegister,
+   InvokeRegister,
+   ReturnRegister,
+   ExitRegister,
+   ArrayRegister,
+   // typed variants of add to greater for operands whose types are known: int, long, float and double
+   AddInt, SubInt, MulInt, DivInt, EqualInt, SmallerInt, GreaterInt,
+   AddLong, SubLong, MulLong, DivLong, EqualLong, SmallerLong, GreaterLong,
+   AddFloat, SubFloat, MulFloat, DivFloat, EqualFloat, SmallerFloat, GreaterFloat,
+   AddDouble, SubDouble, MulDouble, DivDouble, EqualDouble, SmallerDouble, GreaterDouble,
+   AddIntRegister, SubIntRegister, MulIntRegister, DivIntRegister, EqualIntRegister, SmallerIntRegister, GreaterIntRegister,
+   AddLongRegister, SubLongRegister, MulLongRegister, DivLongRegister, EqualLongRegister, SmallerLongRegister, GreaterLongRegister,
+   AddFloatRegister, SubFloatRegister, MulFloatRegister, DivFloatRegister, EqualFloatRegister, SmallerFloatRegister, GreaterFloatRegister,
+   AddDoubleRegister, SubDoubleRegister, MulDoubleRegister, DivDoubleRegister, EqualDoubleRegister, SmallerDoubleRegister, GreaterDoubleRegister,
+   // superinstructions for the most frequent sequences (runtime --profile)
+   PushTwo,
+   IncrementInt,
+   DecrementInt,
+   JumpUnlessEqualInt,
+   JumpUnlessSmallerInt,
+   JumpUnlessGreaterInt,
+   JumpUnlessEqualIntRegister,
+   JumpUnlessSmallerIntRegister,
+   JumpUnlessGreaterIntRegister,
+   // counted for loops: the bound check and the step of the counter in one instruction each
+   LoopInt,
+   NextInt
+};
+
+const uint32_t bytecodeVersion = 4;
+
+// Header flags of bytecode-specs.txt
+const uint8_t varintFields = 0x01;
+const uint8_t compressedSection = 0x02;
+const uint8_t registerCode = 0x04;
+
+// Registers of a frame in the register variant, they follow the locals. Temporaries that don't fit are spilled to
+// slots behind them.
+const int registerCount = 16;
+
+// Matches of the compressed section reach back at most this far, the runtime inflates through a buffer of this size
+const size_t compressionWindow = 4096;
+
+// Writes the program in the format of bytecode-specs.txt. measure() generates the code of every function without
+// output to learn its size and to collect the constants, write() generates it again into a buffer of exactly the
+// measured size. Both passes visit the statements in the same order, so labels and constants get the same numbers.
+class Emitter {
+   public:
+      // With varints the numbers of the header and the tables are LEB128 encoded, the code is the same. With
+      // registers the code uses the register instructions instead of the stack. Typed selects the typed
+      // instructions where the types of the operands are known, fuse the superinstructions.
+      Emitter(SFunction *program, bool varints, bool registers, bool typed, bool fuse);
+
+      // Size of the whole file in bytes, reports the errors of the program
+      size_t measure();
+
+      void write(char *output);
+
+      int getFunctionCount() {
+         return this->functions.size();
+      }
+
+      int getConstantCount() {
+         return this->constants.size();
+      }
+
+      // Literals that refer to a constant, interned ones included
+      int getConstantReferenceCount() {
+         return this->constantReferences.size();
+      }
+
+      int getImmediateCount() {
+         return this->immediates;
+      }
+
+      int getInstructionCount() {
+         return this->instructions;
+      }
+
+      // Temporaries of the register variant that didn't get a register
+      int getSpillCount() {
+         return this->spills;
+      }
+
+      int getTypedCount() {
+         return this->typedInstructions;
+      }
+
+      // Instructions that were fused into superinstructions (push push is one)
+      int getFusedCount() {
+         return this->fused;
+      }
+
+   private:
+      struct Code {
+         SFunction *function;
+         uint32_t size;
+         int locals;
+         int depth; // entries above the locals: operands of the stack code, arguments of the register code
+         vector<uint32_t> labels;
+      };
+
+      // A temporary is a virtual register until linearScan() assigns it a slot
+      struct Operand {
+         PointerType type;
+         int index;
+         bool temporary;
+         TypeCode staticType = TypeCode::Void;
+      };
+
+      // Register variant code before the allocation, operands start with the destination. A label
+      // instruction only places its label.
+      struct Instruction {
+         Opcode opcode;
+         vector<Operand> operands;
+         int label;
+         int count;
+         bool isLabel;
+      };
+
+      // shadowed is the local the name referred to before, -1 if none. Locals are numbered in the order of their
+      // declarations, the index into locals is reused once a scope ends.
+      struct Local {
+         const char *identifier;
+         int slot;
+         int shadowed;
+         bool deleted;
+         int declaration;
+      };
+
+      void collect(Statement *statement);
+      void collect(Value *value);
+      void addFunction(SFunction *function);
+
+      void inferTypes(Code *code);
+      void inferBlock(vector<Statement*> *statements);
+      void inferStatement(Statement *statement);
+      void assign(int declaration, TypeCode type);
+      TypeCode typeOf(Value *value);
+      TypeCode localType(const char *identifier);
+      Opcode select(Operator op, TypeCode first, TypeCode second);
+
+      void emitFunction(Code *code);
+      void emitBlock(vector<Statement*> *statements);
+      void emitStatement(Statement *statement);
+      void emitCondition(SCondition *condition);
+      void emitWhile(SCondition *loop);
+      void emitFor(SFor *loop);
+      bool isCounted(SFor *loop);
+      bool isInvariant(Value *value, SFor *loop);
+      void emitInvariant(Value *value);
+      TypeCode emitValue(Value *value);
+      TypeCode emitOperation(ValueBlock *block);
+      TypeCode emitOperator(Operator op, TypeCode first, TypeCode second);
+      void emitInvoke(ValueInvokeChain *chain);
+      void emitConstant(Constant constant);
+      void emitConstantOperand(Constant constant);
+      int addConstant(Constant constant);
+      void emitSlot(Opcode opcode, int slot);
+      void emitJump(Opcode opcode, int label);
+      void emitJumpUnless(int label);
+      void putTarget(int label);
+      void emit(Opcode opcode);
+      void emitOperand(PointerType type, int index);
+      void push(int count);
+
+      void generateFunction(Code *code);
+      void generateBlock(vector<Statement*> *statements);
+      void generateStatement(Statement *statement);
+      void generateCondition(SCondition *condition);
+      void generateWhile(SCondition *loop);
+      void generateFor(SFor *loop);
+      Operand generateValue(Value *value, const Operand *target);
+      Operand generateOperation(ValueBlock *block);
+      Operand generateInvoke(ValueInvokeChain *chain);
+      Operand generateConstant(Constant constant);
+      Operand temporary();
+      void add(Opcode opcode, vector<Operand> operands, int label = -1, int count = 0);
+      void addJumpUnless(Operand condition, int label);
+      void addLabel(int label);
+      void linearScan(int base);
+      void encode();
+      Operand resolve(Operand operand);
+
+      int newLabel();
+      void place(int label);
+      void enterScope();
+      void leaveScope();
+      int declare(const char *identifier, Statement *statement);
+      void unbind(int index);
+      int findLocal(const char *identifier);
+      int findLocal(const char *identifier, Statement *statement);
+      int findFunction(const char *identifier);
+
+      void put8(uint8_t value);
+      void put16(uint16_t value);
+      void put32(uint32_t value);
+      void putBytes(const char *data, size_t length);
+      void putField(uint64_t value, int width);
+      size_t fieldSize(uint64_t value, int width);
+
+      vector<Code> functions;
+      unordered_map<SFunction*, int> functionIndices;
+      unordered_map<const char*, int> functionNames;
+      vector<Constant> constants;
+      unordered_map<string, int> constantPool;
+      vector<uint16_t> constantReferences;
+      int immediates;
+      int instructions;
+      int typedInstructions;
+      int fused;
+      Code *current;
+      vector<Local> locals;
+      unordered_map<const char*, int> bindings;
+      vector<pair<size_t, int>> scopes;
+      int nextSlot;
+      int nextLabel;
+      int nextConstant;
+      char *output;
+      size_t position;
+      size_t codeStart;
+      int depth; // operands on the stack at the current instruction
+      bool varints;
+      bool registers;
+      bool typed;
+      bool fuse;
+      Opcode lastOpcode; // the last stack instruction and where it starts, for fusing it with the next one
+      size_t lastPosition;
+      vector<int> localTypes; // by declaration, -1 until something is assigned
+      int declarations;
+      bool typesChanged;
+      vector<Instruction> code;
+      vector<int> assigned;
+      int registerBase;
+      int nextTemporary;
+      int spills;
+};
+
+/* Functions */
+
+// TOKENIZER (LEVEL 1)
+
+vector<Token> tokenize(const char *text, int length);
+
+Token nextToken(const char *text, int length);
+Token nextKeywordToken(const char *text, int length);
+Token nextIdentifierToken(const char *text, int length);
+Token nextSpecialToken(const char *text, int length);
+void evaluateToken(const char* text, int *index, vector<Token> *tokens, int length, TokenType *last);
+void evaluateNumber(const char* text, int *index, vector<Token> *tokens, int length);
+void evaluateComment(const char* text, int *index, vector<Token> *tokens, int length);
+void evaluateString(const char* text, int *index, vector<Token> *tokens, int length);
+void evaluateChar(const char* text, int *index, vector<Token> *tokens, int length);
+char* evaluateUnicode(const char* text, int *index, vector<Token> *tokens,  int length);
+int byEscapedCharacter(char c);
+int scanWhitespace(const char *text, int length);
+int scanIdentifier(const char *text, int length);
+int scanDigits(const char *text, int length);
+bool verifyTokenizer(const char *text, int length);
+
+// PARSER (LEVEL 2)
+
+void initStatements();
+TokenResult* verify(TokenStream *tokens);
+TokenResult* verifyContext(TokenNode *node, TokenStream *list, int index);
+TokenResult* verifyEachVariant(TokenNode *node, TokenStream *tokens, int index);
+TokenResult* verifyVariant(variant<TokenNode*, TokenType, const char*> *variant, TokenStream *tokens, int index);
+TokenResult* verifyNode(TokenNode *node, TokenStream *tokens, int index);
+TokenResult* verifyNodeByMode(TokenNode *node, TokenStream *tokens, int index);
+TokenResult* verifyBranch(TokenNode *node, TokenStream *tokens, int index);
+TokenResult* verifyMoreOrNone(TokenNode *node, TokenStream *tokens, int index);
+TokenResult* verifyOnceOrMore(TokenNode *node, TokenStream *tokens, int index);
+TokenResult* verifyOnceOrNone(TokenNode *node, TokenStream *tokens, int index);
+TokenResult* verifyOnce(TokenNode *node, TokenStream *tokens, int index);
+void verifyError(TokenStream *tokens, int index);
+void verifyError(TokenStream *tokens, int index, const char *text);
+void sourceError(int offset, int length);
+void sourceError(int offset, int length, const char *text);
+void reportError(CompileError &error);
+
+// UNIFY (LEVEL 3)
+
+Statement* unify(Statement* container, TokenResult *context);
+Statement* unifyStreamed(TokenResult *statement);
+Statement* unifyStatement(TokenResult *statement);
+Statement* unifyCreate(TokenResult *statement);
+Statement* unifyDelete(TokenResult *statement);
+Statement* unifySet(TokenResult *statement);
 Statement* unifyFor(TokenResult *statement);
 Statement* unifyWhile(TokenResult *statement);
 Statement* unifyIf(TokenResult *statement);
 Statement* unifyFunction(TokenResult *statement);
-Statement* unifyLambda(TokenResult *statement);
+SFunction* unifyLambda(TokenResult *lambda, const char *identifier);
+void unifyParameter(SFunction *function, TokenResult *parameter);
 Statement* unifyInvoke(TokenResult *statement);
 Statement* unifyIncrement(TokenResult *statement);
 Statement* unifyDecrement(TokenResult *statement);
 Statement* unifyExit(TokenResult *statement);
-Statement* unifyValue(TokenResult *value);
+Statement* unifyReturn(TokenResult *statement);
+Value* unifyValue(TokenResult *value);
+Value* unifyPrimitive(Token *token);
+Value* unifyNumber(Token *token);
+Value* unifyMath(TokenResult *construct);
+Value* unifyCompare(TokenResult *construct);
+Value* unifyLogic(TokenResult *construct);
+Operator unifyOperator(TokenResult *result);
+ValueInvokeChain* unifyInvokeChain(TokenResult *chain);
+Value* unifyArray(TokenResult *array);
+Constant constantOf(TypeCode type, uint64_t value, int size);
+uint16_t decodeCharacter(string_view text);
 
 Type* unifyType(TokenResult *result);
 Type* unifyTypeGeneric(TokenResult *result);
@@ -741,8 +1873,21 @@ void validateVariables(TokenResult *context);
 void validateCreate();
 
 
+// OPTIMIZE
+
+TypeCode promote(TypeCode first, TypeCode second);
+int64_t integerOf(Constant *constant);
+template<typename T> T numberOf(Constant *constant);
+
 // TRANSLATE
 
+int precedence(Operator op);
+TypeCode typeCodeOf(Type type);
+TypeCode resultOf(Operator op, TypeCode first, TypeCode second);
+Opcode opcodeOf(Operator op, TypeCode first, TypeCode second);
+Opcode registerOf(Opcode opcode);
+int stackEffect(Opcode opcode);
+bool writes(vector<Statement*> *statements, const char *identifier);
 
 // UTIL
 
@@ -754,155 +1899,330 @@ const char* getTokenTypeByInt(int num);
 
 /* main */
 
-vector<Token> *tokenList;
+TokenStream *tokenList;
+const char *sourceText;
+int sourceLength;
 
 int main(int argsCount, char **args) {
    if(argsCount < 3) {
-      cerr << "Requires two arguments: 1: input file, 2: output file" << endl;
+      cerr << "Requires two arguments: 1: input file, 2: output file (options: --stats, --no-mmap, --no-simd, --check-tokenizer, --stream, --jobs n, --no-optimize, --varint, --compress, --registers, --no-typed, --no-fuse)" << endl;
       return 1;
    }
+
+   for(int i = 3; i < argsCount; i++) {
+      string option(args[i]);
+      if(option == "--stats") {
+         printStats = true;
+      } else if(option == "--no-mmap") {
+         useMmap = false;
+      } else if(option == "--no-simd") {
+         useSimd = false;
+      } else if(option == "--check-tokenizer") {
+         checkTokenizer = true;
+      } else if(option == "--stream") {
+         streamStatements = true;
+      } else if(option == "--no-optimize") {
+         optimizeProgram = false;
+      } else if(option == "--varint") {
+         useVarints = true;
+      } else if(option == "--compress") {
+         useCompression = true;
+      } else if(option == "--registers") {
+         useRegisters = true;
+      } else if(option == "--no-typed") {
+         useTypedOpcodes = false;
+      } else if(option == "--no-fuse") {
+         useSuperinstructions = false;
+      } else if(option == "--jobs" && i + 1 < argsCount) {
+         jobCount = atoi(args[++i]);
+         if(jobCount < 1) {
+            cerr << "--jobs requires a positive number of workers" << endl;
+            return 1;
+         }
+      } else {
+         cerr << "Unknown option: " << option << endl;
+         return 1;
+      }
+   }
    
+   if(streamStatements && jobCount > 1) {
+      cerr << "--stream compiles statement by statement and can't be combined with --jobs" << endl;
+      return 1;
+   }
+
+   ios::sync_with_stdio(false); // cout is buffered from here on, cerr still flushes it first
    endOfFileToken.type = TokenType::EoF;
+   endOfFileToken.text = "<EOF>";
+
+   Arena compilation;
+   Arena literals(4096);
+   arena = &compilation;
+   textArena = &literals;
 
    string inputFileName(args[1]);
    string outputFileName(args[2]);
 
-   string contentStr = readFile(inputFileName.c_str());
-   char *content = charcpy(contentStr.c_str(), contentStr.length());
-   int size = contentStr.length() + 128;
-
-   char *buf = static_cast<char*>(malloc(size));
-   memcpy(buf, contentStr.c_str(), size - 128);
+   int length;
+   auto loadStart = chrono::steady_clock::now();
+   const char *content = useMmap ? mapFile(inputFileName.c_str(), &length) : readFile(inputFileName.c_str(), &length);
+   auto loadEnd = chrono::steady_clock::now();
 
-   for(int i = size - 128; i < size; i++) {
-      if(i % 2 == 0) {
-         buf[i] = '\0';
-      } else {
-         buf[i] = '%';
-      }
+   if(printStats) {
+      double loadTime = chrono::duration<double, milli>(loadEnd - loadStart).count();
+      cout << "Load: " << length << " bytes in " << loadTime << " ms (" << (length / 1048576.0) / (loadTime / 1000.0) << " MB/s) using " << (useMmap ? "mmap" : "read") << endl;
    }
 
-   cout << content << endl;
+   sourceText = content;
+   sourceLength = length;
+   TRACE(1, content);
    
-   vector<Token> tokens = tokenize(buf, contentStr.length());
+   if(checkTokenizer && !verifyTokenizer(content, length)) {
+      return 1;
+   }
+
+   TokenStream tokens(content, length);
    tokenList = &tokens;
 
-   for(Token token : tokens) {
-      cout << "\"" << token.text << "\", ";
+   if(!streamStatements) {
+      auto tokenizeStart = chrono::steady_clock::now();
+      tokens.fill();
+      auto tokenizeEnd = chrono::steady_clock::now();
+
+      if constexpr (TRACE_LEVEL >= 1) {
+         for(int i = 0; i < tokens.size(); i++) {
+            traceSink << "\"" << tokens.at(i).text << "\", ";
+         }
+         traceSink << '\n';
+      }
+
+      if(printStats) {
+         cout << "Tokenize: " << tokens.size() << " tokens from " << length << " bytes in " << chrono::duration<double, milli>(tokenizeEnd - tokenizeStart).count() << " ms, " << literals.getBytes() << " bytes of text materialized" << endl;
+      }
    }
    
    //verifyError(&tokens, 6, "Test error!");
    
-   cout << "Initializing statements..." << endl;
+   TRACE(1, "Initializing statements...");
    initStatements();
 
-   cout << "Verifying statements..." << endl;
+   program = new SFunction(names.intern(""), new Type(BaseType::Void));
+   if(streamStatements) {
+      TRACE(1, "Streaming statements...");
+      statementSink = unifyStreamed;
+   } else {
+      TRACE(1, "Verifying statements...");
+   }
+   auto verifyStart = chrono::steady_clock::now();
+   unique_ptr<FunctionPool> pool;
+   if(jobCount > 1) {
+      pool = make_unique<FunctionPool>(&tokens, jobCount);
+      functionPool = pool.get();
+   }
    TokenResult *result = verify(&tokens);
+   if(pool) {
+      pool->wait();
+   }
+   auto verifyEnd = chrono::steady_clock::now();
+
+   if(printStats) {
+      cout << "Verify: " << tokens.size() << " tokens in " << chrono::duration<double, milli>(verifyEnd - verifyStart).count() << " ms" << (streamStatements ? " (streamed, unify included)" : "") << endl;
+      cout << "Packrat: " << packratHits << " hits, " << packratMisses << " misses, " << packratMemo.size() << " entries" << endl;
+      cout << "Token stream: " << tokens.getCapacity() << " tokens buffered at most" << endl;
+      if(pool) {
+         cout << "Functions: " << pool->getFunctionCount() << " on " << pool->getWorkerCount() << " workers (unify included), " << pool->getHits() << " packrat hits, " << pool->getMisses() << " misses" << endl;
+      }
+   }
    
-   cout << "Unifying statements..." << endl;
-   Statement *context = unify(nullptr, result);
+   if(!streamStatements) {
+      TRACE(1, "Unifying statements...");
+      unify(program, result);
+   }
 
+   if(optimizeProgram) {
+      TRACE(1, "Optimizing statements...");
+      auto optimizeStart = chrono::steady_clock::now();
+      Optimizer optimizer;
+      optimizer.optimize(program);
+      auto optimizeEnd = chrono::steady_clock::now();
+
+      if(printStats) {
+         cout << "Optimize: " << optimizer.getFoldedCount() << " operations folded, " << optimizer.getDecidedCount() << " conditions decided, " << optimizer.getRemovedCount() << " statements removed in " << chrono::duration<double, milli>(optimizeEnd - optimizeStart).count() << " ms" << endl;
+      }
+   }
+
+   TRACE(1, "Emitting bytecode...");
+   auto emitStart = chrono::steady_clock::now();
+   Emitter emitter(program, useVarints, useRegisters, useTypedOpcodes, useSuperinstructions);
+   vector<char> bytecode(emitter.measure());
+   emitter.write(bytecode.data());
+   auto emitEnd = chrono::steady_clock::now();
+   size_t plainSize = bytecode.size();
+   if(useCompression) {
+      bytecode = compressBytecode(bytecode);
+   }
+   auto compressEnd = chrono::steady_clock::now();
+   writeFile(bytecode.data(), bytecode.size(), outputFileName.c_str());
+
+   if(printStats) {
+      cout << "Emit: " << emitter.getFunctionCount() << " functions, " << emitter.getConstantCount() << " constants for " << emitter.getConstantReferenceCount() << " literals, " << emitter.getImmediateCount() << " immediates, " << emitter.getInstructionCount() << " instructions (" << emitter.getTypedCount() << " typed, " << emitter.getFusedCount() << " fused" << (useRegisters ? ", " + to_string(emitter.getSpillCount()) + " spills" : "") << "), " << plainSize << " bytes in " << chrono::duration<double, milli>(emitEnd - emitStart).count() << " ms" << endl;
+   }
+   if(printStats && useCompression) {
+      cout << "Compress: " << plainSize << " -> " << bytecode.size() << " bytes (" << 100.0 * bytecode.size() / plainSize << "%) in " << chrono::duration<double, milli>(compressEnd - emitEnd).count() << " ms" << endl;
+   }
+
+   if(printStats) {
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      cout << "Arena: " << compilation.getAllocations() << " allocations, " << compilation.getBytes() / 1024 << " KB in " << compilation.getBlockCount() << " blocks (" << compilation.getPeakBlockCount() << " at most)" << endl;
+      cout << "Peak RSS: " << usage.ru_maxrss << " KB" << endl;
+   }
+
+   pool.reset();
+   functionPool = nullptr;
+   packratMemo.clear();
+   if(useMmap) {
+      unmapFile(content, length);
+   }
+   literals.release();
+   compilation.release();
    return 0;
 }
 
 /* tokenizer */
 
-vector<Token> tokenize(char *text, int length) {
-   bool comment = false;
-   int index = 0;
+vector<Token> tokenize(const char *text, int length) {
    vector<Token> tokens;
-   TokenType last = TokenType::NewLine;
-   
-   while(index < length) {
-      char first = text[index];
+   Tokenizer tokenizer(text, length);
+   while(tokenizer.next(&tokens)) {
+   }
+   return tokens;
+}
+
+bool Tokenizer::next(vector<Token> *tokens) {
+   if(this->finished) {
+      return false;
+   }
+
+   size_t count = tokens->size();
+   while(this->index < this->length) {
+      char first = this->text[this->index];
       
-      if(first == '#' && last == TokenType::NewLine) {
-         evaluateComment(text, &index, &tokens, length);
+      if(first == '#' && this->last == TokenType::NewLine) {
+         evaluateComment(this->text, &(this->index), tokens, this->length);
       } else if(isNumeric(first)) {
-         evaluateNumber(text, &index, &tokens, length);
+         evaluateNumber(this->text, &(this->index), tokens, this->length);
       } else if(first == '\"') {
-         evaluateString(text, &index, &tokens, length);
+         evaluateString(this->text, &(this->index), tokens, this->length);
       } else if(first == '\'') {
-	 evaluateChar(text, &index, &tokens, length);
+	 evaluateChar(this->text, &(this->index), tokens, this->length);
       } else {
-         evaluateToken(text, &index, &tokens, length, &last);
+         evaluateToken(this->text, &(this->index), tokens, this->length, &(this->last));
       }
-   }
 
-   while(tokens.back().type == TokenType::NewLine) {
-      tokens.pop_back();
+      if(tokens->size() > count) {
+         Token &token = tokens->back();
+         token.trivia = token.offset - this->end;
+         token.index = this->produced++;
+         this->end = token.offset + token.length;
+         return true;
+      }
    }
 
-   Token endToken;
-   endToken.type = TokenType::EoF;
-   endToken.text = charcpy("<EOF>", 5);
-   endToken.length = 5;
-   endToken.index = tokens.size();
-   tokens.push_back(endToken);
+   Token endToken = endOfFileToken;
+   endToken.offset = this->length;
+   endToken.trivia = this->length - this->end;
+   endToken.index = this->produced++;
+   tokens->push_back(endToken);
+   this->finished = true;
+   return true;
+}
 
-   return tokens;
+// Escaped literal text of the released tokens is given back once no token in the window refers to it anymore
+void TokenStream::release(int index) {
+   this->first = max(this->first, min(index, this->count));
+   for(int i = this->first; i < this->count; i++) {
+      Token &token = this->ring[i & this->mask];
+      bool inSource = token.text.data() >= sourceText && token.text.data() <= sourceText + sourceLength;
+      if((token.type == TokenType::String || token.type == TokenType::Char) && !inSource) {
+         return;
+      }
+   }
+   textArena->release();
 }
 
-void evaluateToken(char* text, int *index, vector<Token> *tokens, int length, TokenType *last) {
+void evaluateToken(const char* text, int *index, vector<Token> *tokens, int length, TokenType *last) {
    Token token = nextToken(&text[*index], length - (*index));
    *last = token.type;
+   token.offset = *index;
    *index += token.length;
+   if(token.type == TokenType::Separator || token.type == TokenType::NewLine) {
+      return;
+   }
    token.index = tokens->size();
    tokens->push_back(token);
 }
 
-void evaluateNumber(char* text, int *index, vector<Token> *tokens, int length) {
+void evaluateNumber(const char* text, int *index, vector<Token> *tokens, int length) {
    Token numberToken;
    numberToken.type = TokenType::Number;
+   numberToken.offset = *index;
    bool terminated = false;
-   string buffer;
    
-   while(!terminated) {
+   while(!terminated && *index < length) {
       char next = text[*index];
       if(isNumeric(next)) {
-         buffer += next;
+         *index += scanDigits(&text[*index], length - *index);
       } else {
          switch(next) {
             case '.':
             case '-':
             case '+':
             case 'e':
-	       buffer += next;
 	       break;
 
             case 'd':
             case 'f':
-	       buffer += next;
+	       (*index)++;
+	       terminated = true;
+	       break;
+
             default: 
 	       terminated = true;
 	       break;
 	 }
-      }
 
-      if(!terminated) {
-         (*index)++;
+         if(!terminated) {
+            (*index)++;
+         }
       }
    }
 
-   numberToken.text = charcpy(buffer.c_str(), buffer.length());
-   numberToken.length = buffer.length();
+   numberToken.length = *index - numberToken.offset;
+   numberToken.text = string_view(&text[numberToken.offset], numberToken.length);
    numberToken.index = tokens->size();
    tokens->push_back(numberToken);
 }
 
-void evaluateComment(char* text, int *index, vector<Token> *tokens, int length) {
-   while(text[*index] != '\n') {
+void evaluateComment(const char* text, int *index, vector<Token> *tokens, int length) {
+   while(*index < length && text[*index] != '\n') {
       (*index)++;
    }
 }
 
-void evaluateString(char* text, int *index, vector<Token> *tokens, int length) {
+// Strings are views into the source, only strings containing escapes are copied (once) into the arena
+void evaluateString(const char* text, int *index, vector<Token> *tokens, int length) {
+   int start = *index;
    (*index)++;
    string strText;
+   bool escaped = false;
    bool terminated = false;
    
    while(*index < length && !terminated) {
       if(text[*index] == '\\') {
+         if(!escaped) {
+            strText.assign(&text[start + 1], *index - start - 1);
+            escaped = true;
+         }
          if((*index) + 1 < length) {
 	    char next = text[(*index) + 1];
             if(next == 'u') {
@@ -913,7 +2233,7 @@ void evaluateString(char* text, int *index, vector<Token> *tokens, int length) {
 	    } else {
 	       int escapedValue = byEscapedCharacter(next);
 	       if(escapedValue == -1) {
-                  verifyError(tokens, tokens->size() - 1, "Unknown escaped character!");
+                  sourceError(*index, 2, "Unknown escaped character!");
 	       }
 	       strText += (char) escapedValue;
 	       (*index)++;
@@ -924,7 +2244,7 @@ void evaluateString(char* text, int *index, vector<Token> *tokens, int length) {
       } else {
 	 if(text[*index] == '\"') {
             terminated = true;
-	 } else {
+	 } else if(escaped) {
             strText += text[*index];
          }
       }
@@ -932,21 +2252,29 @@ void evaluateString(char* text, int *index, vector<Token> *tokens, int length) {
    }
 
    if(!terminated) {
-      verifyError(tokens, tokens->size() - 1, "String was never terminated!");
+      sourceError(start, *index - start, "String was never terminated!");
    }
 
    Token stringToken;
    stringToken.type = TokenType::String;
-   stringToken.length = strText.length();
-   stringToken.text = charcpy(strText.c_str(), strText.length());
+   stringToken.offset = start;
+   stringToken.length = *index - start;
+   if(escaped) {
+      char *copy = static_cast<char*>(textArena->allocate(strText.length() + 1, 1));
+      memcpy(copy, strText.c_str(), strText.length() + 1);
+      stringToken.text = string_view(copy, strText.length());
+   } else {
+      stringToken.text = string_view(&text[start + 1], stringToken.length - 2);
+   }
    stringToken.index = tokens->size();
    tokens->push_back(stringToken);
 }
 
-void evaluateChar(char* text, int *index, vector<Token> *tokens, int length) {
+void evaluateChar(const char* text, int *index, vector<Token> *tokens, int length) {
    Token charToken;
    charToken.type = TokenType::Char;
    charToken.index = tokens->size();
+   charToken.offset = *index;
 
    int end = *index;
    for(int i = end; i < length; i++) {
@@ -957,50 +2285,44 @@ void evaluateChar(char* text, int *index, vector<Token> *tokens, int length) {
       }
    }
 
-   charToken.text = charcpy(&text[(*index)], end - *index);
    charToken.length = end - *index;
-   tokens->push_back(charToken);
    
    (*index)++;
-   char *character;
    
    if(*index + 1 >= length) {
-      verifyError(tokens, tokens->size() - 1, "Char was never terminated!");
+      sourceError(charToken.offset, charToken.length, "Char was never terminated!");
    } else if(text[(*index)] == '\'') {
-      verifyError(tokens, tokens->size() - 1, "Char was terminated without specifying a character!");
+      sourceError(charToken.offset, charToken.length, "Char was terminated without specifying a character!");
    }   
 
    if(text[(*index)] == '\\') {
       char next = text[(*index) + 1];
       if(next == 'u') {
-         character = evaluateUnicode(text, index, tokens, length);
+         charToken.text = evaluateUnicode(text, index, tokens, length);
 	 (*index) += 6;
       } else {
 	 int escapedValue = byEscapedCharacter(next);
          if(escapedValue == -1) {
-            verifyError(tokens, tokens->size() - 1, "Unknown escaped character!");
+            sourceError(*index, 2, "Unknown escaped character!");
          }
-         character = reinterpret_cast<char*>(malloc(2));
+         char *character = static_cast<char*>(textArena->allocate(2, 1));
          character[0] = (char) escapedValue;
 	 character[1] = '\0';
+         charToken.text = string_view(character, 1);
          (*index) += 2; 
       }
    } else {
-      character = reinterpret_cast<char*>(malloc(2));
-      character[0] = text[(*index)];
-      character[1] = '\0';
+      charToken.text = string_view(&text[(*index)], 1);
       (*index)++;
    }
   
    if(text[(*index)] != '\'') {
-      verifyError(tokens, tokens->size() - 1, "Expected single quote to terminate the character!");
+      sourceError(charToken.offset, charToken.length, "Expected single quote to terminate the character!");
    }
 
    (*index)++;
    
-   charToken.length = strlen(character);
-   charToken.text = charcpy(character, charToken.length);
-   tokens->pop_back();
+   charToken.length = *index - charToken.offset;
    tokens->push_back(charToken);
 }
 
@@ -1024,22 +2346,27 @@ int byEscapedCharacter(char c) {
    }
 }
 
-char* evaluateUnicode(char* text, int *index, vector<Token> *tokens, int length) {
+char* evaluateUnicode(const char* text, int *index, vector<Token> *tokens, int length) {
    if((*index) + 4 >= length) {
-      verifyError(tokens, tokens->size() - 1, "End of file reached during unicode sequence! Expected at least 4 hex characters!");
+      sourceError(*index, length - *index, "End of file reached during unicode sequence! Expected at least 4 hex characters!");
    }
 
    int value = hextoint(text, (*index) + 2, 4); 
 
    if(value == -1) {
-      verifyError(tokens, tokens->size() - 1, "Non-hex character found in unicode sequence!");
+      sourceError(*index, 6, "Non-hex character found in unicode sequence!");
    } 
 
-   char *placeholder = reinterpret_cast<char*>(malloc(3));
+   char *placeholder = static_cast<char*>(textArena->allocate(4, 1));
 
-   if(value > 127) {
-      placeholder[0] = (char) 194; // UTF-8 2 byte encoding
-      placeholder[1] = (char) value;
+   if(value > 0x7FF) { // UTF-8 3 byte encoding
+      placeholder[0] = (char) (0xE0 | (value >> 12));
+      placeholder[1] = (char) (0x80 | ((value >> 6) & 0x3F));
+      placeholder[2] = (char) (0x80 | (value & 0x3F));
+      placeholder[3] = '\0';
+   } else if(value > 127) { // UTF-8 2 byte encoding
+      placeholder[0] = (char) (0xC0 | (value >> 6));
+      placeholder[1] = (char) (0x80 | (value & 0x3F));
       placeholder[2] = '\0';
    } else {
       placeholder[0] = (char) value;
@@ -1049,7 +2376,7 @@ char* evaluateUnicode(char* text, int *index, vector<Token> *tokens, int length)
    return placeholder;
 }
 
-Token nextToken(char *text, int length) {
+Token nextToken(const char *text, int length) {
    char first = text[0];
 
    if(first == 0 || length == 0) {
@@ -1064,14 +2391,23 @@ Token nextToken(char *text, int length) {
       }
    }
 
+   // a whole run of blanks becomes a single separator
+   if(characterTable.classes[static_cast<unsigned char>(first)] & classWhitespace) {
+      Token token;
+      token.type = TokenType::Separator;
+      token.length = scanWhitespace(text, length);
+      token.text = string_view(text, token.length);
+      return token;
+   }
+
    return nextSpecialToken(text, length);
 }
 
-Token nextSpecialToken(char *text, int length) {
+Token nextSpecialToken(const char *text, int length) {
    char first = text[0];    
   
    Token token;
-   token.text = charcpy(text, 1);
+   token.text = string_view(text, 1);
    
    switch(text[0]) {
       case '+': token.type = TokenType::Plus; break;
@@ -1079,9 +2415,15 @@ Token nextSpecialToken(char *text, int length) {
       case '*': token.type = TokenType::Star; break;
       case '/': token.type = TokenType::Slash; break;
 
-      case ' ': 
-      case '	': 
-      case '\r': token.type = TokenType::Separator; break;
+      case '\r':
+	 if(length > 1 && text[1] == '\n') {
+            token.type = TokenType::NewLine;
+	    token.text = string_view(text, 2);
+	    token.length = 2;
+	    return token;
+	 }
+	 token.type = TokenType::Separator;
+	 break;
       
       case '(': token.type = TokenType::BracketOpen; break;
       case ')': token.type = TokenType::BracketClose; break;
@@ -1117,74 +2459,183 @@ Token nextSpecialToken(char *text, int length) {
    return token;
 }
 
-Token nextIdentifierToken(char *text, int length) {
-   int index = 0;
-   while(index < length && text[index] != '\0') {
-      char c = text[index];
-      if(isAlphabetic(c) || (index > 0 && (c == '$' || isNumeric(c)))) {
-         index++;
-      } else {
-         break;
-      }
-   }
-
-   if(index == 0) {
+Token nextIdentifierToken(const char *text, int length) {
+   if(length < 1 || !isAlphabetic(text[0])) {
       return endOfFileToken;
    }
 
+   int index = 1 + scanIdentifier(&text[1], length - 1);
+
    Token token;
    token.type = TokenType::Identifier;
-   token.text = charcpy(text, index);
+   token.text = string_view(text, index);
    token.length = index;
    return token;
 }
 
-Token nextKeywordToken(char *text, int length) {
-   int basetypeLength = arrayFind(&basetypes, text, length);
-   int keywordLength = arrayFind(&keywords, text, length);
-
-   if(keywordLength + basetypeLength < 1) {
-      return nextIdentifierToken(text, length);
-   }
-
-   Token token;
-   token.type = basetypeLength == 0 ? TokenType::Keyword : TokenType::BaseType;
-   token.length = keywordLength + basetypeLength;
-   token.text = charcpy(text, token.length);
+Token nextKeywordToken(const char *text, int length) {
+   Token token = nextIdentifierToken(text, length);
+   token.type = findKeyword(text, token.length);
    return token;
 }
 
-/* verify */
+#if TOKENIZER_SIMD
+#ifdef __AVX2__
+inline __m256i inRange(__m256i chunk, char low, char high) {
+   return _mm256_and_si256(_mm256_cmpgt_epi8(chunk, _mm256_set1_epi8(low - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), chunk));
+}
 
-TokenResult* verify(vector<Token> *tokens) {
-   cout << "verify: " << endl;
-   TokenResult *result = verifyContext(contextNode, tokens, 0);
-   cout << "Parsing success: " << result->isSatisfied() << endl;
-   return result;
+// One bit per leading byte of text that has the given class
+inline uint32_t classMask(const char *text, uint8_t flag) {
+   __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text));
+   __m256i match;
+   if(flag == classWhitespace) {
+      match = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t')));
+   } else if(flag == classDigit) {
+      match = inRange(chunk, '0', '9');
+   } else {
+      __m256i letters = inRange(_mm256_or_si256(chunk, _mm256_set1_epi8(0x20)), 'a', 'z');
+      match = _mm256_or_si256(_mm256_or_si256(letters, inRange(chunk, '0', '9')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('$')));
+   }
+   return static_cast<uint32_t>(_mm256_movemask_epi8(match));
 }
 
-TokenResult* verifyContext(TokenNode *node, vector<Token> *list, int index) {
-   cout << "verifyContext: " << endl;
-   TokenResult *result = new TokenResult(node, true);
-   variant<TokenNode*, TokenType, const char*> terminator = "done";
-   bool terminated = false;
+constexpr int simdWidth = 32;
+constexpr uint32_t simdFull = 0xFFFFFFFF;
+#else
+inline __m128i inRange(__m128i chunk, char low, char high) {
+   return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(chunk, _mm_set1_epi8(high + 1)));
+}
 
-   const char* error_eof = "Expected a new statement, but the file suddenly ended! What have you done?! °–°";
-   const char* error_invalid_statement = "Expected a new statement, but the first token doesn't make any sense :c";
+// One bit per leading byte of text that has the given class
+inline uint32_t classMask(const char *text, uint8_t flag) {
+   __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text));
+   __m128i match;
+   if(flag == classWhitespace) {
+      match = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')));
+   } else if(flag == classDigit) {
+      match = inRange(chunk, '0', '9');
+   } else {
+      __m128i letters = inRange(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 'z');
+      match = _mm_or_si128(_mm_or_si128(letters, inRange(chunk, '0', '9')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('$')));
+   }
+   return static_cast<uint32_t>(_mm_movemask_epi8(match));
+}
+
+constexpr int simdWidth = 16;
+constexpr uint32_t simdFull = 0xFFFF;
+#endif
+#endif
+
+// Length of the run of characters of the given class at the start of text
+inline int scanClass(const char *text, int length, uint8_t flag) {
+   int index = 0;
+#if TOKENIZER_SIMD
+   if(useSimd) {
+      while(index + simdWidth <= length) {
+         uint32_t mask = classMask(&text[index], flag);
+         if(mask != simdFull) {
+            return index + __builtin_ctz(~mask);
+         }
+         index += simdWidth;
+      }
+   }
+#endif
+   while(index < length && (characterTable.classes[static_cast<unsigned char>(text[index])] & flag)) {
+      index++;
+   }
+   return index;
+}
+
+int scanWhitespace(const char *text, int length) {
+   return scanClass(text, length, classWhitespace);
+}
+
+int scanIdentifier(const char *text, int length) {
+   return scanClass(text, length, classIdentifier);
+}
+
+int scanDigits(const char *text, int length) {
+   return scanClass(text, length, classDigit);
+}
+
+// Tokenizes the source with and without the SIMD scanners and compares both token streams (--check-tokenizer)
+bool verifyTokenizer(const char *text, int length) {
+   vector<Token> tokens = tokenize(text, length);
+   bool simd = useSimd;
+   useSimd = false;
+   vector<Token> reference = tokenize(text, length);
+   useSimd = simd;
+
+   size_t count = min(tokens.size(), reference.size());
+   for(size_t i = 0; i < count; i++) {
+      Token &token = tokens[i];
+      Token &expected = reference[i];
+      if(token.type != expected.type || token.offset != expected.offset || token.length != expected.length || token.trivia != expected.trivia || token.text != expected.text) {
+         cerr << "Tokenizer mismatch at token " << i << ": \"" << token.text << "\" (" << getTokenTypeByInt((int) token.type) << ", offset " << token.offset
+              << ") but the scalar tokenizer found \"" << expected.text << "\" (" << getTokenTypeByInt((int) expected.type) << ", offset " << expected.offset << ")" << endl;
+         return false;
+      }
+   }
+
+   if(tokens.size() != reference.size()) {
+      cerr << "Tokenizer mismatch: " << tokens.size() << " tokens but the scalar tokenizer found " << reference.size() << endl;
+      return false;
+   }
+
+   cout << "Tokenizer check: " << tokens.size() << " tokens identical to the scalar tokenizer" << (TOKENIZER_SIMD ? "" : " (built without SIMD)") << endl;
+   return true;
+}
+
+/* verify */
+
+TokenResult* verify(TokenStream *tokens) {
+   TRACE(1, "verify: ");
+   packratMemo.clear();
+   packratHits = 0;
+   packratMisses = 0;
+
+   TokenResult *result = verifyContext(contextNode, tokens, 0);
+   TRACE(1, "Parsing success: " << result->isSatisfied());
+   return result;
+}
+
+TokenResult* verifyContext(TokenNode *node, TokenStream *list, int index) {
+   TRACE(2, "verifyContext: ");
+   TokenResult *result = arena->make<TokenResult>(node, true);
+   variant<TokenNode*, TokenType, const char*> terminator = "done";
+   bool terminated = false;
+   int start = index;
+   bool streaming = start == 0 && statementSink != nullptr;
+
+   const char* error_eof = "Expected a new statement, but the file suddenly ended! What have you done?! °–°";
+   const char* error_invalid_statement = "Expected a new statement, but the first token doesn't make any sense :c";
    const char* error_generic = "Invalid statement! An error occurred!";
 
    do {
       bool success = false;
-      TokenResult *max = new TokenResult(nullptr, false);
+      Arena::Mark mark = arena->mark();
+      TokenResult *max = arena->make<TokenResult>(nullptr, false);
 
       Token next = list->at(result->getTokenCount() + index);
       if(next.type == TokenType::EoF) {
-	 if(index == 0) {
+	 if(start == 0) {
             return result;
 	 }
          verifyError(list, index + result->getTokenCount(), error_eof);
       }
 
+      if(start == 0 && functionPool != nullptr) {
+         FunctionJob *job = functionPool->take(index + result->getTokenCount());
+         if(job != nullptr && job->failed && !job->failedInUnify) {
+            reportError(job->error);
+         }
+         if(job != nullptr && job->result->isSatisfied()) {
+            result->addVerified(job->result, job->tokenCount);
+            continue;
+         }
+      }
+
       TokenResult *terminatorResult = verifyVariant(&terminator, list, index + result->getTokenCount());
 
       if(terminatorResult->isSatisfied()) { 
@@ -1194,19 +2645,28 @@ TokenResult* verifyContext(TokenNode *node, vector<Token> *list, int index) {
       }
       
       for(TokenNode& node : *ast) {
-	 cout << "Trying to detect statement" << node.getName() << endl;
+	 TRACE(2, "Trying to detect statement" << node.getName());
          TokenResult *subResult = verifyEachVariant(&node, list, index + result->getTokenCount());
          if(!subResult->isSatisfied()) {
 	    if(subResult->getMatchedTokens() > max->getMatchedTokens()) {
 	       max = subResult;
-	       cout << "FAIL: UPDATED MAX: " << max->getMatchedTokens() << "TOKENS IN SUBRESULT" << endl;
+	       TRACE(2, "FAIL: UPDATED MAX: " << max->getMatchedTokens() << "TOKENS IN SUBRESULT");
 	    } else {
-               cout << "FAIL, BUT NOT UPDATING: UNSKIPPED: " << subResult->getMatchedTokens()  << endl; 
+               TRACE(2, "FAIL, BUT NOT UPDATING: UNSKIPPED: " << subResult->getMatchedTokens());
 	    }   
 	 } else {
-	    cout << "STATEMENT SUCCESS: " << node.getName() << endl;
+	    TRACE(2, "STATEMENT SUCCESS: " << node.getName());
             success = true;
-	    result->add(subResult);
+	    if(streaming) {
+               // handed on and forgotten right away, so memory is bounded by the largest statement
+	       index += subResult->getTokenCount();
+	       statementSink(subResult);
+	       packratMemo.clear();
+	       list->release(index);
+	       arena->rewind(mark);
+	    } else {
+	       result->add(subResult);
+	    }
 	    break;
 	 }
       }
@@ -1214,7 +2674,7 @@ TokenResult* verifyContext(TokenNode *node, vector<Token> *list, int index) {
       if(!success) {
 	 if(max->isEof()) {
             verifyError(list, index + result->getTokenCount() + max->getTokenCount(), error_eof);
-	 } else if(result->getTokenCount() < 1) {
+	 } else if(index - start + result->getTokenCount() < 1) {
             verifyError(list, index + result->getTokenCount() + max->getTokenCount(), error_invalid_statement);
 	 } else {
             verifyError(list, index + result->getTokenCount() + max->getTokenCount(), max->hasMessage() ? max->getMessage() : error_generic);
@@ -1223,29 +2683,29 @@ TokenResult* verifyContext(TokenNode *node, vector<Token> *list, int index) {
 
    } while(!terminated);
 
-   cout << "MOVING 1 LAYER UP" << endl;
+   TRACE(2, "MOVING 1 LAYER UP");
    return result;
 }
 
-TokenResult* verifyEachVariant(TokenNode *node, vector<Token> *tokens, int index) {
-   cout << "verifyEachVariant: " << endl;
-   TokenResult *result = new TokenResult(node, true);
+TokenResult* verifyEachVariant(TokenNode *node, TokenStream *tokens, int index) {
+   TRACE(3, "verifyEachVariant: ");
+   TokenResult *result = arena->make<TokenResult>(node, true);
 
    for(variant<TokenNode*, TokenType, const char*> variantObj : *(node->getList())) {
       int localIndex = index + result->getTokenCount();
-      cout << "INDEX: " << index << ", LOCAL: " << localIndex << endl; 
+      TRACE(3, "INDEX: " << index << ", LOCAL: " << localIndex);
 
       TokenResult *subResult = verifyVariant(&variantObj, tokens, localIndex);
       
-      cout << "SIZE: " << result->getTokens()->size() << " SKIPPED: " << subResult->getSkipped() << endl;
-      cout << "SATISFIED: " << result->isSatisfied() << endl;
+      TRACE(3, "SIZE: " << result->getTokens()->size());
+      TRACE(3, "SATISFIED: " << result->isSatisfied());
 
       if(subResult->isEof()) {
          result->setEof();
       }
 
       if(!subResult->isSatisfied()) {
-	 cout << "RETURNING FAIL" << endl;
+	 TRACE(3, "RETURNING FAIL");
 	 result->add(subResult);
 	 result->setSatisfied(false);
 	 if(subResult->hasMessage()) {
@@ -1256,7 +2716,6 @@ TokenResult* verifyEachVariant(TokenNode *node, vector<Token> *tokens, int index
       
       if(subResult->getNode() == nullptr) {
 	 result->add(subResult->getTokens()->at(0));
-      	 result->incSkipped(subResult->getSkipped());
       } else {
          result->add(subResult);
       }
@@ -1264,26 +2723,18 @@ TokenResult* verifyEachVariant(TokenNode *node, vector<Token> *tokens, int index
    return result;
 }
 
-TokenResult* verifyVariant(variant<TokenNode*, TokenType, const char*> *variantObj, vector<Token> *tokens, int index) {
-   cout << "verifyVariant: " << endl;
+TokenResult* verifyVariant(variant<TokenNode*, TokenType, const char*> *variantObj, TokenStream *tokens, int index) {
+   TRACE(3, "verifyVariant: ");
    
-   TokenResult *result = new TokenResult(nullptr, true);
    Token token = tokens->at(index);
 
    if(holds_alternative<TokenNode*>(*variantObj)) {
-      delete result;
       TokenNode *node = get<TokenNode*>(*variantObj);
       return verifyNode(node, tokens, index);
    } else {
-      while(token.type == TokenType::Separator || token.type == TokenType::NewLine) {
-	 result->skip();
-	 index++;
-	 token = tokens->at(index);
-      	 cout << "SKIP" << endl;
-      } 
-
-      if(tokens->at(index).type == TokenType::EoF) {
-         cout << "RAN INTO EOF: THIS PART IS OPTIONAL THOUGH: IGNORING" << endl;
+      TokenResult *result = arena->make<TokenResult>(nullptr, true);
+      if(token.type == TokenType::EoF) {
+         TRACE(3, "RAN INTO EOF: THIS PART IS OPTIONAL THOUGH: IGNORING");
          result->setSatisfied(false);
          result->setEof();
 	 return result;
@@ -1292,10 +2743,10 @@ TokenResult* verifyVariant(variant<TokenNode*, TokenType, const char*> *variantO
       if(holds_alternative<const char*>(*variantObj)) {
 	  const char *keyword = get<const char*>(*variantObj);
           
-	  bool stringsAreEqual = strcmp(keyword, token.text) == 0;
+	  bool stringsAreEqual = token.text == keyword;
 	  if(token.type != TokenType::Keyword || !stringsAreEqual) {
-	     cout << "REAL TOKEN NOT OF CORRECT TYPE: " << (token.type != TokenType::Keyword ? "true" : "false") << endl;
-	     cout << "'" << token.text << "' IS NOT '" << keyword << "'" <<  endl;
+	     TRACE(3, "REAL TOKEN NOT OF CORRECT TYPE: " << (token.type != TokenType::Keyword ? "true" : "false"));
+	     TRACE(3, "'" << token.text << "' IS NOT '" << keyword << "'");
              if(!stringsAreEqual) {
 		string msg;
 		msg += "This is not the correct keyword, expected: ";
@@ -1304,37 +2755,51 @@ TokenResult* verifyVariant(variant<TokenNode*, TokenType, const char*> *variantO
 	     }
 	     result->setSatisfied(false);
 	  } else {
-             cout << "CORRECT TOKEN: " << token.text << endl;
+             TRACE(3, "CORRECT TOKEN: " << token.text);
 	  }
 
-	  cout << token.text << " ADDED TO RESULT" << endl;
+	  TRACE(3, token.text << " ADDED TO RESULT");
 	  result->add(token);
       } else if(holds_alternative<TokenType>(*variantObj)) {
 	 TokenType targetType = get<TokenType>(*variantObj);
 	 
 	 if(targetType != token.type) {
-            const char *nameOfType = getTokenTypeByInt(static_cast<int>(targetType)); 
-	    cout << "'" << token.text << "' IS NOT CORRECT TOKENTYPE: " << nameOfType <<  endl;
+	    TRACE(3, "'" << token.text << "' IS NOT CORRECT TOKENTYPE: " << getTokenTypeByInt(static_cast<int>(targetType)));
             string msg;
 	    msg += "This is not the correct token, expected type: ";
 	    msg += static_cast<int>(targetType);
             result->setMessage(charcpy(msg.c_str(), msg.length()));
 	    result->setSatisfied(false);
 	 } else {
-            cout << "CORRECT TOKEN: " << token.text << endl;
+            TRACE(3, "CORRECT TOKEN: " << token.text);
 	 }
 	    
-	 cout << token.text << " ADDED TO RESULT" << endl;
+	 TRACE(3, token.text << " ADDED TO RESULT");
 	 result->add(token);
       }
+      return result;
    }
-   return result;
 }
 
-TokenResult* verifyNode(TokenNode *node, vector<Token> *tokens, int index) {
+// Every (node, index) pair is parsed at most once, later attempts reuse the result (packrat parsing)
+TokenResult* verifyNode(TokenNode *node, TokenStream *tokens, int index) {
+   PackratKey key = { node, index };
+   auto memoized = packratMemo.find(key);
+
+   if(memoized != packratMemo.end()) {
+      packratHits++;
+      return memoized->second;
+   }
+
+   packratMisses++;
+   TokenResult *result = verifyNodeByMode(node, tokens, index);
+   packratMemo[key] = result;
+   return result;
+}
 
+TokenResult* verifyNodeByMode(TokenNode *node, TokenStream *tokens, int index) {
    if(strlen(node->getName()) > 0) {
-      cout << "ATTEMPT VERIFY OF: " << node->getName() << endl;
+      TRACE(2, "ATTEMPT VERIFY OF: " << node->getName());
    }
 
    if(node->getList()->size() == 0) {
@@ -1342,39 +2807,39 @@ TokenResult* verifyNode(TokenNode *node, vector<Token> *tokens, int index) {
    }
 	
    if(node->getMode() == TokenMode::ONCE) {
-      cout << "MODE: ONCE" << endl; 
+      TRACE(3, "MODE: ONCE");
       return verifyOnce(node, tokens, index);
    } else if(node->getMode() == TokenMode::ONCE_OR_NONE) {
-      cout << "MODE: ONCE_OR_NONE" << endl; 
+      TRACE(3, "MODE: ONCE_OR_NONE");
       return verifyOnceOrNone(node, tokens, index);
    } else if(node->getMode() == TokenMode::ONCE_OR_MORE) {
-      cout << "MODE: ONCE_OR_MORE" << endl; 
+      TRACE(3, "MODE: ONCE_OR_MORE");
       return verifyOnceOrMore(node, tokens, index);
    } else if(node->getMode() == TokenMode::BRANCH) {
-      cout << "MODE: BRANCH" << endl;
+      TRACE(3, "MODE: BRANCH");
       return verifyBranch(node, tokens, index); 
    } else {
-      cout << "MODE: MORE_OR_NONE" << endl; 
+      TRACE(3, "MODE: MORE_OR_NONE");
       return verifyMoreOrNone(node, tokens, index);
    }
 }
 
 void debugBranchFail(variant<TokenNode*, TokenType, const char*> variantObj, TokenNode *node) {
    if(holds_alternative<TokenNode*>(variantObj)) {
-      cout << "BRANCH FAIL ON: " << node->getName() << ": COULDN'T VERIFY BRANCH: " << get<TokenNode*>(variantObj)->getName() << endl;
+      TRACE(2, "BRANCH FAIL ON: " << node->getName() << ": COULDN'T VERIFY BRANCH: " << get<TokenNode*>(variantObj)->getName());
    } else if(holds_alternative<TokenType>(variantObj)) {
-      cout << "BRANCH FAIL ON: " << node->getName() << ": COULDN'T VERIFY BRANCH: Expected Token to be: " << getTokenTypeByInt(static_cast<int>(get<TokenType>(variantObj))) << endl;
+      TRACE(2, "BRANCH FAIL ON: " << node->getName() << ": COULDN'T VERIFY BRANCH: Expected Token to be: " << getTokenTypeByInt(static_cast<int>(get<TokenType>(variantObj))));
    } else {
-      cout << "BRANCH FAIL ON: " << node->getName() << ": COULDN'T VERIFY BRANCH: Expected Token to be keyword: " << get<const char*>(variantObj) << endl;
+      TRACE(2, "BRANCH FAIL ON: " << node->getName() << ": COULDN'T VERIFY BRANCH: Expected Token to be keyword: " << get<const char*>(variantObj));
    }
 }
 
-TokenResult* verifyBranch(TokenNode *node, vector<Token> *tokens, int index) {
-   TokenResult *max = new TokenResult(nullptr, false);
+TokenResult* verifyBranch(TokenNode *node, TokenStream *tokens, int index) {
+   TokenResult *max = arena->make<TokenResult>(nullptr, false);
    for(variant<TokenNode*, TokenType, const char*> variantObj : *(node->getList())) {
       TokenResult *branchResult = verifyVariant(&variantObj, tokens, index);
       if(branchResult->isSatisfied()) {
-         TokenResult *result = new TokenResult(node, true);
+         TokenResult *result = arena->make<TokenResult>(node, true);
          result->add(branchResult);
 	 return result;
       } else if(branchResult->getTokenCount() > max->getTokenCount()) {
@@ -1384,20 +2849,20 @@ TokenResult* verifyBranch(TokenNode *node, vector<Token> *tokens, int index) {
    }
 
    if(max == nullptr) {
-      return new TokenResult(node, false);
+      return arena->make<TokenResult>(node, false);
    } else {
       return max;
    }
 }
 
-TokenResult* verifyMoreOrNone(TokenNode *node, vector<Token> *tokens, int index) { 
+TokenResult* verifyMoreOrNone(TokenNode *node, TokenStream *tokens, int index) { 
    TokenResult *result = verifyOnceOrMore(node, tokens, index);
    result->setSatisfied(true);
    return result;
 }
 
-TokenResult* verifyOnceOrMore(TokenNode *node, vector<Token> *tokens, int index) {
-   TokenResult *result = new TokenResult(node, true);
+TokenResult* verifyOnceOrMore(TokenNode *node, TokenStream *tokens, int index) {
+   TokenResult *result = arena->make<TokenResult>(node, true);
    bool failed = false;
     
    do {
@@ -1416,21 +2881,21 @@ TokenResult* verifyOnceOrMore(TokenNode *node, vector<Token> *tokens, int index)
    return result;
 }
 
-TokenResult* verifyOnceOrNone(TokenNode *node, vector<Token> *tokens, int index) {
+TokenResult* verifyOnceOrNone(TokenNode *node, TokenStream *tokens, int index) {
    TokenResult *result = verifyOnce(node, tokens, index);
    if(!result->isSatisfied()) {
-      result->getTokens()->clear();
+      result->clear();
    }
    result->setSatisfied(true);
    return result;
 }
 
-TokenResult* verifyOnce(TokenNode *node, vector<Token> *tokens, int index) {
+TokenResult* verifyOnce(TokenNode *node, TokenStream *tokens, int index) {
     return verifyEachVariant(node, tokens, index);
 }
 
 void initStatements() {
-   ast = new vector<TokenNode>();
+   ast = arena->make<vector<TokenNode>>();
    contextNode = (new TokenNode {})->withName("context"); 
 
    TokenNode *primitiveBare = (new TokenNode {
@@ -1855,90 +3320,240 @@ void initStatements() {
    ast->push_back(*function_);
 }
 
-void verifyError(vector<Token> *tokens, int index, const char *text) {
-   cout << endl;
-   cout << "Error Message: " << text;
-   verifyError(tokens, index);
+void verifyError(TokenStream *tokens, int index, const char *text) {
+   Token &token = tokens->at(index);
+   if(token.type == TokenType::EoF) {
+      sourceError(token.offset - token.trivia, 0, text);
+   }
+   sourceError(token.offset, token.length, text);
+}
+
+void verifyError(TokenStream *tokens, int index) {
+   verifyError(tokens, index, nullptr);
+}
+
+void sourceError(int offset, int length) {
+   sourceError(offset, length, nullptr);
+}
+
+void reportError(CompileError &error) {
+   if(error.offset < 0) {
+      compilerError(error.text);
+   }
+   sourceError(error.offset, error.length, error.text);
 }
 
-void verifyError(vector<Token> *tokens, int index) {
+// Prints the line containing the span with a caret under its last character, an empty span marks the end of the file
+void sourceError(int offset, int length, const char *text) {
+   if(deferErrors) {
+      throw CompileError { offset, length, text };
+   }
+
+   if(text != nullptr) {
+      cout << endl;
+      cout << "Error Message: " << text;
+   }
+
    int lineCount = 1;
-   int tokenIndex = 0;
+   int lineStart = 0;
 
-   for(int i = 0; i < index; i++) {
-      if((*tokens)[i].type == TokenType::NewLine) {
-          lineCount++;
-	  tokenIndex = i;
+   for(int i = 0; i < offset; i++) {
+      if(sourceText[i] == '\n') {
+         lineCount++;
+         lineStart = i + 1;
       }
    }
-  
+
+   int lineEnd = lineStart;
+   while(lineEnd < sourceLength && sourceText[lineEnd] != '\n' && sourceText[lineEnd] != '\r') {
+      lineEnd++;
+   }
+
    cerr << endl;
    cerr << "Error is located in line " << lineCount << ": " << endl << endl;
-   
-   int lineErrorIndex = 0;
+   cerr << string_view(&sourceText[lineStart], lineEnd - lineStart);
+   if(length == 0) {
+      cerr << endOfFileToken.text;
+   }
+   cerr << endl;
 
-   for(int i = tokenIndex; i < tokens->size(); i++) {
-      if(i <= index) {
-         lineErrorIndex += (*tokens)[i].length;
-      }
-      if(tokens->at(i).type == TokenType::NewLine || tokens->at(i).type == TokenType::EoF) {
-	 if(tokens->at(i).type == TokenType::EoF) {
-            cerr << tokens->at(i).text;
-	 }
-	 break;
+   for(int i = lineStart; i < offset + max(length, 1) - 1 && i < lineEnd; i++) {
+      cerr << (sourceText[i] == '\t' ? '\t' : '-');
+   }
+
+   cerr << "^" << endl;
+   exit(1);
+}
+
+/* function pool */
+
+FunctionPool::FunctionPool(TokenStream *tokens, int workerCount) {
+   this->tokens = tokens;
+   this->functionNode = nullptr;
+   this->nextJob = 0;
+   this->hits = 0;
+   this->misses = 0;
+   this->taken = 0;
+
+   for(TokenNode &node : *ast) {
+      if(strcmp(node.getName(), "function") == 0) {
+         this->functionNode = &node;
       }
-      if(tokens->at(i).type == TokenType::String) {
-         cerr << "\"" <<(*tokens)[i].text << "\"";
-      } else if(tokens->at(i).type == TokenType::Char) {
-         cerr << "'" <<(*tokens)[i].text << "'";
-      } else {
-         cerr << (*tokens)[i].text;
+   }
+
+   // if, while, for, else and lambdas (") :" followed by a type) open a block, done closes it
+   int depth = 0;
+   for(int i = 0; tokens->at(i).type != TokenType::EoF; i++) {
+      Token token = tokens->at(i);
+      if(token.type == TokenType::Keyword) {
+         if(token.text == "function" && depth == 0) {
+            unique_ptr<FunctionJob> job = make_unique<FunctionJob>();
+            job->start = i;
+            job->tokenCount = 0;
+            job->result = nullptr;
+            job->statement = nullptr;
+            job->failed = false;
+            job->failedInUnify = false;
+            job->finished = job->done.get_future();
+            this->jobs.push_back(move(job));
+         } else if(token.text == "if" || token.text == "while" || token.text == "for") {
+            depth++;
+         } else if(token.text == "done") {
+            depth = max(depth - 1, 0);
+         }
+      } else if(token.text == "else" && tokens->at(i + 1).text != "if") {
+         depth++;
+      } else if(token.type == TokenType::BracketClose && tokens->at(i + 1).type == TokenType::Colon 
+            && (tokens->at(i + 2).type == TokenType::BaseType || tokens->at(i + 2).type == TokenType::Identifier)) {
+         depth++;
       }
    }
 
-   cerr << endl;
+   workerCount = min(workerCount, (int) this->jobs.size());
+   for(int i = 0; i < workerCount; i++) {
+      this->arenas.push_back(make_unique<Arena>());
+   }
+   for(int i = 0; i < workerCount; i++) {
+      this->workers.emplace_back(&FunctionPool::work, this, i);
+   }
+}
 
-   for(int i = 0; i < lineErrorIndex - 1; i++) {
-      cerr << "-";
+FunctionJob* FunctionPool::take(int index) {
+   while(this->taken < this->jobs.size() && this->jobs[this->taken]->start < index) {
+      this->taken++;
+   }
+   if(this->taken == this->jobs.size() || this->jobs[this->taken]->start != index) {
+      return nullptr;
    }
 
-   cerr << "^" << endl;
-   exit(1);
+   FunctionJob *job = this->jobs[this->taken++].get();
+   job->finished.wait();
+   if(job->result != nullptr) {
+      this->results[job->result] = job;
+   }
+   return job;
+}
+
+void FunctionPool::work(int worker) {
+   arena = this->arenas[worker].get();
+   deferErrors = true;
+
+   for(size_t next = this->nextJob++; next < this->jobs.size(); next = this->nextJob++) {
+      FunctionJob *job = this->jobs[next].get();
+      bool unifying = false;
+      packratMemo.clear();
+      try {
+         job->result = verifyEachVariant(this->functionNode, this->tokens, job->start);
+         job->tokenCount = job->result->getTokenCount();
+         if(job->result->isSatisfied()) {
+            unifying = true;
+            job->statement = unifyStatement(job->result);
+         }
+      } catch(CompileError &error) {
+         job->failed = true;
+         job->failedInUnify = unifying;
+         job->error = error;
+      }
+      job->done.set_value();
+   }
+
+   packratMemo.clear();
+   this->hits += packratHits;
+   this->misses += packratMisses;
 }
 
 /* unify */
 
-Statement* unify(Statement* owner, TokenResult *result) {
-  if(owner == nullptr) {
-     owner = new Statement("root");
-  }
+// Children are only read, never taken out of a result: packrat results are shared between parents and the
+// results of the workers are unified on their own thread
+TokenResult* resultAt(TokenResult *result, int index) {
+   variant<TokenResult*, Token> &element = result->getTokens()->at(index);
+   if(!holds_alternative<TokenResult*>(element)) {
+      compilerError("Compiler error: Expected a result, but found a token!");
+   }
+   return get<TokenResult*>(element);
+}
+
+Token* tokenAt(TokenResult *result, int index) {
+   variant<TokenResult*, Token> &element = result->getTokens()->at(index);
+   if(!holds_alternative<Token>(element)) {
+      compilerError("Compiler error: Expected a token, but found a result!");
+   }
+   return &(get<Token>(element));
+}
+
+const char* identifierAt(TokenResult *result, int index) {
+   return names.intern(tokenAt(result, index)->text);
+}
+
+bool isNamed(TokenResult *result, const char *name) {
+   return result->getNode() != nullptr && strcmp(result->getNode()->getName(), name) == 0;
+}
 
+Statement* unify(Statement* owner, TokenResult *result) {
   for(variant<TokenResult*, Token> statement : *(result->getTokens())) {
     if(holds_alternative<Token>(statement)) {
        verifyError(tokenList, get<Token>(statement).index, "Expected statement, not individual token!");
     }
-    unifyStatement(get<TokenResult*>(statement));
+    TokenResult *statementResult = get<TokenResult*>(statement);
+    if(statementResult->getNode() == nullptr) { // done
+       continue;
+    }
+    FunctionJob *job = owner == program && functionPool != nullptr ? functionPool->byResult(statementResult) : nullptr;
+    if(job == nullptr) {
+       owner->add(unifyStatement(statementResult));
+    } else if(job->failedInUnify) {
+       reportError(job->error);
+    } else {
+       owner->add(job->statement);
+    }
   }
-  return nullptr;
+  return owner;
 }
 
+// Statement sink of --stream: the statements are unified one by one and collected in the program
+Statement* unifyStreamed(TokenResult *result) {
+   Statement *statement = unifyStatement(result);
+   program->add(statement);
+   return statement;
+}
 
 Statement* unifyStatement(TokenResult *result) {
    //TokenNode node; 
    string name = result->getNode()->getName();
 
    if("create" == name) { return unifyCreate(result); } else  
-   if("delete" == name) { return unifyCreate(result); } else  
-   if("for" == name) { return unifyCreate(result); } else  
-   if("set" == name) { return unifyCreate(result); } else  
-   if("while" == name) { return unifyCreate(result); } else  
-   if("if" == name) { return unifyCreate(result); } else  
-   if("invoke" == name) { return unifyCreate(result); } else  
-   if("function" == name) { return unifyCreate(result); } else  
-   if("return" == name) { return unifyCreate(result); } else  
-   if("exit" == name) { return unifyCreate(result); } else  
-   if("increment" == name) { return unifyCreate(result); } else  
-   if("decrement" == name) { return unifyCreate(result); } else {
+   if("delete" == name) { return unifyDelete(result); } else  
+   if("for" == name) { return unifyFor(result); } else  
+   if("set" == name) { return unifySet(result); } else  
+   if("while" == name) { return unifyWhile(result); } else  
+   if("if" == name) { return unifyIf(result); } else  
+   if("invoke" == name) { return unifyInvoke(result); } else  
+   if("function" == name) { return unifyFunction(result); } else  
+   if("return" == name) { return unifyReturn(result); } else  
+   if("exit" == name) { return unifyExit(result); } else  
+   if("increment" == name) { return unifyIncrement(result); } else  
+   if("decrement" == name) { return unifyDecrement(result); } else {
       verifyError(tokenList, result->getFirstToken()->index, "Unexpected statement!");
    }
    return nullptr;
@@ -1958,40 +3573,358 @@ void printResult(TokenResult *result) {
    cout << " } ";
 }
 
+// create identifier (set value | : type)
 Statement* unifyCreate(TokenResult *result) {
-   cout << "Unify: " << "create" << endl;
-   Token create = result->popToken();
-   Token identifier = result->popToken();
+   TRACE(1, "Unify: " << "create");
+   const char *identifier = identifierAt(result, 1);
+   TokenResult *assign = resultAt(resultAt(result, 2), 0);
+
+   Statement *statement;
+   if(isNamed(assign, "createset")) {
+      statement = new SCreate(identifier, nullptr, unifyValue(resultAt(assign, 1)));
+   } else { // addontype
+      statement = new SCreate(identifier, unifyType(resultAt(assign, 1)), nullptr);
+   }
+   statement->locate(tokenAt(result, 1));
+   return statement;
+}
 
-   TokenResult* next = result->popResult();
-   if(string(next->getNode()->getName()) == "createset") {
-      
-   } else { // typeorassign
-       
+// delete identifier
+Statement* unifyDelete(TokenResult *result) {
+   Statement *statement = new SDelete(identifierAt(result, 1));
+   statement->locate(tokenAt(result, 1));
+   return statement;
+}
+
+// set identifier to value
+Statement* unifySet(TokenResult *result) {
+   Statement *statement = new SSet(identifierAt(result, 1), unifyValue(resultAt(result, 3)));
+   statement->locate(tokenAt(result, 1));
+   return statement;
+}
+
+// for until [above | below] limit [up | down] step [set counter]: context
+Statement* unifyFor(TokenResult *result) {
+   TokenResult *bound = resultAt(result, 2);
+   TokenResult *direction = resultAt(result, 4);
+   TokenResult *counter = resultAt(result, 6);
+
+   bool down = !direction->isEmpty() && direction->getFirstToken()->text == "down";
+   bool above = bound->isEmpty() ? down : bound->getFirstToken()->text == "above";
+
+   SFor *loop = new SFor(unifyValue(resultAt(result, 3)), unifyValue(resultAt(result, 5)), down, above, counter->isEmpty() ? nullptr : identifierAt(counter, 1));
+   loop->locate(tokenAt(result, 0));
+   unify(loop, resultAt(result, 8));
+   return loop;
+}
+
+// while value: context
+Statement* unifyWhile(TokenResult *result) {
+   SCondition *loop = new SCondition("while", unifyValue(resultAt(result, 1)));
+   loop->locate(tokenAt(result, 0));
+   unify(loop, resultAt(result, 3));
+   return loop;
+}
+
+// if value: context {else if ...} [else context]
+Statement* unifyIf(TokenResult *result) {
+   SCondition *condition = new SCondition("if", unifyValue(resultAt(result, 1)));
+   condition->locate(tokenAt(result, 0));
+   unify(condition, resultAt(result, 3));
+
+   SCondition *last = condition;
+   for(variant<TokenResult*, Token> &elseIf : *(resultAt(result, 4)->getTokens())) {
+      SCondition *next = static_cast<SCondition*>(unifyIf(resultAt(get<TokenResult*>(elseIf), 1)));
+      last->setOtherwise(next);
+      while(next->getOtherwise() != nullptr && strcmp(next->getOtherwise()->getName(), "if") == 0) {
+         next = static_cast<SCondition*>(next->getOtherwise());
+      }
+      last = next;
    }
-   return nullptr;
+
+   TokenResult *otherwise = resultAt(result, 5);
+   if(!otherwise->isEmpty()) {
+      Statement *block = new Statement("else");
+      block->locate(tokenAt(otherwise, 0));
+      last->setOtherwise(unify(block, resultAt(otherwise, 1)));
+   }
+   return condition;
+}
+
+// function identifier lambda
+Statement* unifyFunction(TokenResult *result) {
+   SFunction *function = unifyLambda(resultAt(result, 2), identifierAt(result, 1));
+   function->locate(tokenAt(result, 1));
+   return function;
 }
 
-Statement* unifyDelete(TokenResult *result);
-Statement* unifySet(TokenResult *result);
-Statement* unifyFor(TokenResult *result);
-Statement* unifyWhile(TokenResult *result);
-Statement* unifyIf(TokenResult *result);
-Statement* unifyFunction(TokenResult *result);
-Statement* unifyLambda(TokenResult *result);
-Statement* unifyInvoke(TokenResult *result);
-Statement* unifyIncrement(TokenResult *result);
-Statement* unifyDecrement(TokenResult *result);
-Statement* unifyExit(TokenResult *context);
-
-Statement* unifyValue(TokenResult *value) {
-   cout << "Unifying value..." << endl;
-   Unresolved unresolved(value);
-   vector<Token>* references = unresolved.getReferences();
-   for(Token& t : *references) {
-      cout << t.text << endl;
+// ([parameter {, parameter}]): type context
+SFunction* unifyLambda(TokenResult *result, const char *identifier) {
+   SFunction *function = new SFunction(identifier, unifyType(resultAt(result, 4)));
+   function->locate(tokenAt(result, 0));
+
+   TokenResult *parameters = resultAt(result, 1);
+   if(!parameters->isEmpty()) {
+      unifyParameter(function, resultAt(parameters, 0));
+      for(variant<TokenResult*, Token> &separated : *(resultAt(parameters, 1)->getTokens())) {
+         unifyParameter(function, resultAt(get<TokenResult*>(separated), 1));
+      }
    }
-   return nullptr;
+
+   unify(function, resultAt(result, 5));
+   return function;
+}
+
+// identifier: type
+void unifyParameter(SFunction *function, TokenResult *result) {
+   Variable parameter(PointerType::STACK, *unifyType(resultAt(resultAt(result, 1), 1)), identifierAt(result, 0));
+   function->addParameter(&parameter);
+}
+
+Statement* unifyInvoke(TokenResult *result) {
+   Statement *statement = new SInvoke(unifyInvokeChain(resultAt(result, 1)));
+   statement->locate(tokenAt(result, 0));
+   return statement;
+}
+
+Statement* unifyIncrement(TokenResult *result) {
+   Statement *statement = new SStep("increment", identifierAt(result, 1));
+   statement->locate(tokenAt(result, 1));
+   return statement;
+}
+
+Statement* unifyDecrement(TokenResult *result) {
+   Statement *statement = new SStep("decrement", identifierAt(result, 1));
+   statement->locate(tokenAt(result, 1));
+   return statement;
+}
+
+Statement* unifyExit(TokenResult *result) {
+   Statement *statement = new SResult("exit", unifyValue(resultAt(result, 1)));
+   statement->locate(tokenAt(result, 0));
+   return statement;
+}
+
+Statement* unifyReturn(TokenResult *result) {
+   Statement *statement = new SResult("return", unifyValue(resultAt(result, 1)));
+   statement->locate(tokenAt(result, 0));
+   return statement;
+}
+
+// Operations become flat blocks of operands and operators, the emitter applies the precedence
+Value* unifyValue(TokenResult *result) {
+   if(result->getNode() == nullptr || isNamed(result, "primitivebare")) {
+      return unifyPrimitive(result->getFirstToken());
+   }
+
+   string name = result->getNode()->getName();
+   if(name == "constructmath") {
+      return unifyMath(result);
+   } else if(name == "constructcomparebare") {
+      return unifyCompare(result);
+   } else if(name == "constructlogic") {
+      return unifyLogic(result);
+   } else if(name == "functionCallChain") {
+      return unifyInvokeChain(result);
+   } else if(name == "array") {
+      return unifyArray(result);
+   } else if(name == "lambda") {
+      ValueFunction *value = new ValueFunction(unifyLambda(result, names.intern("")));
+      value->locate(tokenAt(result, 0));
+      return value;
+   } else if(name == "valueenclosed" || name == "primitiveenclosed" || name == "constructmathenclosed" 
+         || name == "constructcompareenclosed" || name == "constructlogicenclosed") {
+      return unifyValue(resultAt(result, 1));
+   }
+   return unifyValue(resultAt(result, 0)); // value, valuebare, primitive, math, compare, logic and their operands
+}
+
+Value* unifyPrimitive(Token *token) {
+   Value *value = nullptr;
+   if(token->type == TokenType::Identifier || token->type == TokenType::Keyword) {
+      if(token->text == "true" || token->text == "false") {
+         value = new ValuePrimitive(Type(BaseType::Bool), constantOf(TypeCode::Bool, token->text == "true", 1));
+      } else {
+         value = new ValueIdentifier(names.intern(token->text));
+      }
+   } else if(token->type == TokenType::Number) {
+      value = unifyNumber(token);
+   } else if(token->type == TokenType::String) {
+      Type type(BaseType::Array);
+      type.addGenericType(new Type(BaseType::Char));
+      value = new ValuePrimitive(type, Constant { TypeCode::String, string(token->text) });
+   } else if(token->type == TokenType::Char) {
+      value = new ValuePrimitive(Type(BaseType::Char), constantOf(TypeCode::Char, decodeCharacter(token->text), 2));
+   } else {
+      sourceError(token->offset, token->length, "Expected a value!");
+   }
+   value->locate(token);
+   return value;
+}
+
+// Integers are int unless they need a long, decimals are double unless they end with f
+Value* unifyNumber(Token *token) {
+   string text(token->text);
+   char *end;
+   errno = 0;
+
+   if(text.find_first_of(".eEfd") == string::npos) {
+      long long number = strtoll(text.c_str(), &end, 10);
+      if(*end != '\0' || errno == ERANGE) {
+         sourceError(token->offset, token->length, "Invalid integer, the number doesn't fit into a long!");
+      }
+      if(number >= INT_MIN && number <= INT_MAX) {
+         return new ValuePrimitive(Type(BaseType::Int), constantOf(TypeCode::Int, static_cast<uint32_t>(number), 4));
+      }
+      return new ValuePrimitive(Type(BaseType::Long), constantOf(TypeCode::Long, static_cast<uint64_t>(number), 8));
+   }
+
+   bool single = text.back() == 'f';
+   if(text.back() == 'f' || text.back() == 'd') {
+      text.pop_back();
+   }
+   double number = strtod(text.c_str(), &end);
+   if(*end != '\0' || text.empty()) {
+      sourceError(token->offset, token->length, "Invalid decimal number!");
+   }
+
+   if(single) {
+      float value = static_cast<float>(number);
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      return new ValuePrimitive(Type(BaseType::Float), constantOf(TypeCode::Float, bits, 4));
+   }
+   uint64_t bits;
+   memcpy(&bits, &number, sizeof(bits));
+   return new ValuePrimitive(Type(BaseType::Double), constantOf(TypeCode::Double, bits, 8));
+}
+
+// operand operator operand {operator operand}
+Value* unifyMath(TokenResult *result) {
+   ValueBlock *block = new ValueBlock();
+   block->locate(result->getFirstToken());
+   block->addElement(unifyValue(resultAt(result, 0)));
+   block->addElement(unifyOperator(resultAt(result, 1)));
+   block->addElement(unifyValue(resultAt(result, 2)));
+
+   for(variant<TokenResult*, Token> &pair : *(resultAt(result, 3)->getTokens())) {
+      block->addElement(unifyOperator(resultAt(get<TokenResult*>(pair), 0)));
+      block->addElement(unifyValue(resultAt(get<TokenResult*>(pair), 1)));
+   }
+   return block;
+}
+
+// operand operator operand, a >= b is !(a < b) and a <= b is !(a > b)
+Value* unifyCompare(TokenResult *result) {
+   ValueBlock *block = new ValueBlock();
+   block->locate(result->getFirstToken());
+   TokenResult *comparison = resultAt(resultAt(result, 1), 0);
+
+   block->addElement(unifyValue(resultAt(result, 0)));
+   if(isNamed(comparison, "greaterequals")) {
+      block->addElement(Operator::Smaller);
+   } else if(isNamed(comparison, "smallerequals")) {
+      block->addElement(Operator::Greater);
+   } else {
+      block->addElement(unifyOperator(resultAt(result, 1)));
+   }
+   block->addElement(unifyValue(resultAt(result, 2)));
+
+   if(isNamed(comparison, "greaterequals") || isNamed(comparison, "smallerequals")) {
+      ValueBlock *negated = new ValueBlock();
+      negated->locate(result->getFirstToken());
+      negated->addElement(Operator::Not);
+      negated->addElement(block);
+      return negated;
+   }
+   return block;
+}
+
+// [!] operand operator [!] operand {operator [!] operand}
+Value* unifyLogic(TokenResult *result) {
+   ValueBlock *block = new ValueBlock();
+   block->locate(result->getFirstToken());
+
+   for(int i = 0; i < 5; i++) {
+      TokenResult *element = resultAt(result, i);
+      if(isNamed(element, "not")) {
+         if(!element->isEmpty()) {
+            block->addElement(Operator::Not);
+         }
+      } else if(isNamed(element, "operatorlogic")) {
+         block->addElement(unifyOperator(element));
+      } else {
+         block->addElement(unifyValue(element));
+      }
+   }
+
+   for(variant<TokenResult*, Token> &triple : *(resultAt(result, 5)->getTokens())) {
+      TokenResult *addon = get<TokenResult*>(triple);
+      block->addElement(unifyOperator(resultAt(addon, 0)));
+      if(!resultAt(addon, 1)->isEmpty()) {
+         block->addElement(Operator::Not);
+      }
+      block->addElement(unifyValue(resultAt(addon, 2)));
+   }
+   return block;
+}
+
+Operator unifyOperator(TokenResult *result) {
+   TokenResult *choice = resultAt(result, 0);
+   if(isNamed(choice, "and")) { return Operator::And; } else
+   if(isNamed(choice, "or")) { return Operator::Or; } else
+   if(isNamed(choice, "equals")) { return Operator::Equal; } else
+   if(isNamed(choice, "greater")) { return Operator::Greater; } else
+   if(isNamed(choice, "smaller")) { return Operator::Smaller; }
+
+   switch(choice->getFirstToken()->type) {
+      case TokenType::Plus: return Operator::Add;
+      case TokenType::Minus: return Operator::Sub;
+      case TokenType::Star: return Operator::Mul;
+      case TokenType::Slash: return Operator::Div;
+      default:
+         compilerError("Compiler error: Unknown operator!");
+         return Operator::Add;
+   }
+}
+
+// [domain or value] ::name([value {, value}]) {::name(...)}
+ValueInvokeChain* unifyInvokeChain(TokenResult *result) {
+   ValueInvokeChain *chain = new ValueInvokeChain();
+   chain->locate(result->getFirstToken());
+   TokenResult *domain = resultAt(result, 0);
+   ValueIdentifier space(domain->isEmpty() ? nullptr : names.intern(domain->getFirstToken()->text));
+
+   for(variant<TokenResult*, Token> &element : *(resultAt(result, 1)->getTokens())) {
+      TokenResult *call = get<TokenResult*>(element);
+      ValueInvoke *invoke = new ValueInvoke(chain->getChain()->empty() ? space : ValueIdentifier(nullptr), ValueIdentifier(identifierAt(call, 2)));
+      invoke->locate(tokenAt(call, 2));
+
+      TokenResult *arguments = resultAt(call, 4);
+      if(!arguments->isEmpty()) {
+         invoke->addParameter(unifyValue(resultAt(arguments, 0)));
+         for(variant<TokenResult*, Token> &addon : *(resultAt(arguments, 1)->getTokens())) {
+            invoke->addParameter(unifyValue(resultAt(get<TokenResult*>(addon), 1)));
+         }
+      }
+      chain->add(invoke);
+   }
+   return chain;
+}
+
+// [[value {, value}]]
+Value* unifyArray(TokenResult *result) {
+   ValueArray *array = new ValueArray();
+   array->locate(tokenAt(result, 0));
+
+   TokenResult *body = resultAt(result, 1);
+   if(!body->isEmpty()) {
+      array->addElement(unifyValue(resultAt(body, 0)));
+      for(variant<TokenResult*, Token> &argument : *(resultAt(body, 1)->getTokens())) {
+         array->addElement(unifyValue(resultAt(get<TokenResult*>(argument), 1)));
+      }
+   }
+   return array;
 }
 
 Type* unifyType(TokenResult *result) {
@@ -2021,6 +3954,9 @@ Type* unifyTypeGeneric(TokenResult *result) {
    Type *type = unifyBaseType(typeToken);
    
    TokenResult *list = get<TokenResult*>(result->getTokens()->at(2));
+   if(list->isEmpty()) {
+      return type;
+   }
    TokenResult* firstGenericResult = get<TokenResult*>(list->getTokens()->at(0));
    
    Type* firstGeneric = unifyType(firstGenericResult);
@@ -2041,9 +3977,9 @@ Type* unifyTypeGeneric(TokenResult *result) {
 
 Type* unifyBaseType(Token *typeToken) {
    if(typeToken->type == TokenType::Identifier) {
-      return new Type(typeToken->text);
+      return new Type(names.intern(typeToken->text));
    }
-   string type = typeToken->text;
+   string type(typeToken->text);
    if(type == "bool") { return new Type(BaseType::Bool); } else
    if(type == "char") { return new Type(BaseType::Char); } else
    if(type == "byte") { return new Type(BaseType::Byte); } else
@@ -2052,86 +3988,2080 @@ Type* unifyBaseType(Token *typeToken) {
    if(type == "float") { return new Type(BaseType::Float); } else
    if(type == "double") { return new Type(BaseType::Double); } else
    if(type == "long") { return new Type(BaseType::Long); } else
-   if(type == "void") { return new Type(BaseType::Void); } else {
-      verifyError(tokenList, typeToken->index, "Error unifying BaseType: Expected one of [bool, char, byte, int, short, float, double, long, void]!");
+   if(type == "void") { return new Type(BaseType::Void); } else
+   if(type == "array") { return new Type(BaseType::Array); } else {
+      verifyError(tokenList, typeToken->index, "Error unifying BaseType: Expected one of [bool, char, byte, int, short, float, double, long, void, array]!");
       return new Type(BaseType::Void);
    }
 }
 
-/* util */
+Constant constantOf(TypeCode type, uint64_t value, int size) {
+   Constant constant { type, string(size, '\0') };
+   for(int i = 0; i < size; i++) {
+      constant.data[i] = static_cast<char>(value >> (8 * i));
+   }
+   return constant;
+}
 
-int arrayFind(vector<const char*> *vec, char *text, int length) {
-   for(const char*& candidate : *vec) {
-      //if(strcmp(candidate, text) == 0) {
-	// return length;
-      //}
-      if(strlen(candidate) > length) {
-         continue;
-      }
+// First code point of UTF-8 text, chars are stored as UTF-16 code units
+uint16_t decodeCharacter(string_view text) {
+   if(text.empty()) {
+      return 0;
+   }
+   unsigned char first = text[0];
+   if(first >= 0xE0 && text.length() >= 3) {
+      return ((first & 0x0F) << 12) | ((text[1] & 0x3F) << 6) | (text[2] & 0x3F);
+   } else if(first >= 0xC0 && text.length() >= 2) {
+      return ((first & 0x1F) << 6) | (text[1] & 0x3F);
+   }
+   return first;
+}
 
-      bool finished = false;
-      int j = 0;
+/* optimize */
 
-      while(candidate[j] == text[j]) {
-         if(text[j] == 0) {
-	    finished = true;
-	    break;
-	 }
+void Optimizer::optimize(SFunction *function) {
+   this->optimizeBlock(function->getStatements());
+}
 
-         j++;
-      }
+void Optimizer::optimizeBlock(vector<Statement*> *statements) {
+   vector<Statement*> result;
+   for(size_t i = 0; i < statements->size(); i++) {
+      Statement *statement = statements->at(i);
+      this->optimizeStatement(statement, &result);
 
-      if(finished || candidate[j] == 0) {
-	 if(isNumeric(text[j]) || isAlphabetic(text[j]) || text[j] == '$') {
-	    continue;
-	 }
-         return j;
+      if(strcmp(statement->getName(), "exit") == 0 || strcmp(statement->getName(), "return") == 0) {
+         for(i++; i < statements->size(); i++) {
+            this->drop(statements->at(i), &result);
+         }
       }
-   }  
-   return 0;
+   }
+   statements->swap(result);
 }
 
+// Appends what is left of the statement to the result
+void Optimizer::optimizeStatement(Statement *statement, vector<Statement*> *result) {
+   const char *name = statement->getName();
 
-char* charcpy(const char *src, int length) {
-   char *copy = static_cast<char*>(malloc(length + 1));
-   memcpy(copy, src, length);
-   copy[length] = 0;
-   return copy;
+   if(strcmp(name, "function") == 0) {
+      this->optimize(static_cast<SFunction*>(statement));
+   } else if(strcmp(name, "create") == 0) {
+      SCreate *create = static_cast<SCreate*>(statement);
+      if(create->getValue() != nullptr) {
+         create->setValue(this->fold(create->getValue()));
+      }
+   } else if(strcmp(name, "set") == 0) {
+      static_cast<SSet*>(statement)->setValue(this->fold(static_cast<SSet*>(statement)->getValue()));
+   } else if(strcmp(name, "exit") == 0 || strcmp(name, "return") == 0) {
+      static_cast<SResult*>(statement)->setValue(this->fold(static_cast<SResult*>(statement)->getValue()));
+   } else if(strcmp(name, "invoke") == 0) {
+      this->fold(static_cast<SInvoke*>(statement)->getChain());
+   } else if(strcmp(name, "for") == 0) {
+      SFor *loop = static_cast<SFor*>(statement);
+      loop->setLimit(this->fold(loop->getLimit()));
+      loop->setStep(this->fold(loop->getStep()));
+      this->optimizeBlock(loop->getStatements());
+   } else if(strcmp(name, "while") == 0) {
+      SCondition *loop = static_cast<SCondition*>(statement);
+      loop->setCondition(this->fold(loop->getCondition()));
+      if(this->isBool(loop->getCondition(), false)) {
+         this->decided++;
+         for(Statement *child : *(loop->getStatements())) {
+            this->drop(child, result);
+         }
+         return;
+      }
+      this->optimizeBlock(loop->getStatements());
+   } else if(strcmp(name, "if") == 0) {
+      statement = this->optimizeCondition(static_cast<SCondition*>(statement), result);
+      if(statement == nullptr) {
+         return;
+      }
+   }
+   result->push_back(statement);
 }
 
-string readFile(const char *filename) {
-   string inputFileName(filename);
-   ifstream inputFile(inputFileName);
+// The branch taken if the condition is known (nullptr if there is none), otherwise the condition with optimized branches
+Statement* Optimizer::optimizeCondition(SCondition *condition, vector<Statement*> *result) {
+   condition->setCondition(this->fold(condition->getCondition()));
+   Statement *otherwise = condition->getOtherwise();
 
-   if(!inputFile.is_open()){
-      cerr << "Unable to open file '" << filename << "' for writing" << endl;
-      exit(1);
+   if(this->isBool(condition->getCondition(), true)) {
+      this->decided++;
+      if(otherwise != nullptr) {
+         this->drop(otherwise, result);
+      }
+      this->optimizeBlock(condition->getStatements());
+      return this->toBlock(condition);
+   } else if(this->isBool(condition->getCondition(), false)) {
+      this->decided++;
+      for(Statement *child : *(condition->getStatements())) {
+         this->drop(child, result);
+      }
+      if(otherwise == nullptr) {
+         return nullptr;
+      } else if(strcmp(otherwise->getName(), "if") == 0) {
+         return this->optimizeCondition(static_cast<SCondition*>(otherwise), result);
+      }
+      this->optimizeBlock(otherwise->getStatements());
+      return this->toBlock(otherwise);
+   }
+
+   this->optimizeBlock(condition->getStatements());
+   if(otherwise != nullptr && strcmp(otherwise->getName(), "if") == 0) {
+      condition->setOtherwise(this->optimizeCondition(static_cast<SCondition*>(otherwise), result));
+   } else if(otherwise != nullptr) {
+      this->optimizeBlock(otherwise->getStatements());
    }
+   return condition;
+}
 
-   string inputContent;
+// The body of a branch that is always taken, it keeps its own scope
+Statement* Optimizer::toBlock(Statement *statement) {
+   Statement *block = new Statement("block");
+   for(Statement *child : *(statement->getStatements())) {
+      block->add(child);
+   }
+   return block;
+}
 
-   while(inputFile) {
-       int read = inputFile.get();
-       if(read == 13 || read == -1) {
-           continue;
-       }
-       inputContent.push_back((char) read);
-       cout << read << endl;
+// Functions in dropped code are moved to the result
+void Optimizer::drop(Statement *statement, vector<Statement*> *result) {
+   if(strcmp(statement->getName(), "function") == 0) {
+      this->optimizeStatement(statement, result);
+      return;
    }
+   this->removed++;
 
-   return inputContent; 
+   vector<Statement*> functions;
+   for(Statement *child : *(statement->getStatements())) {
+      this->drop(child, &functions);
+   }
+   if(strcmp(statement->getName(), "if") == 0 && static_cast<SCondition*>(statement)->getOtherwise() != nullptr) {
+      this->drop(static_cast<SCondition*>(statement)->getOtherwise(), &functions);
+   }
+   this->removed -= functions.size();
+   result->insert(result->end(), functions.begin(), functions.end());
 }
 
-void writeFile(const char *src, const char *filename) {
-   ofstream outputFile(filename); 
-   if(!outputFile.is_open()) {
-      cout << "Unable to open " << filename << " for writing, exiting!";
-      exit(-1);
+Value* Optimizer::fold(Value *value) {
+   switch(value->getOperandType()) {
+      case OperandType::Block:
+         return this->foldBlock(static_cast<ValueBlock*>(value));
+      case OperandType::InvokeChain:
+         for(ValueInvoke *invoke : *(static_cast<ValueInvokeChain*>(value)->getChain())) {
+            for(Value *&parameter : *(invoke->getParameters())) {
+               parameter = this->fold(parameter);
+            }
+         }
+         return value;
+      case OperandType::Array:
+         for(Value *&element : *(static_cast<ValueArray*>(value)->getElements())) {
+            element = this->fold(element);
+         }
+         return value;
+      case OperandType::Function:
+         this->optimize(static_cast<ValueFunction*>(value)->getFunction());
+         return value;
+      default:
+         return value;
    }
-   cout << "TODO: Writing to file" << endl;
 }
 
-int hextoint(char *text, int offset, int length) {
+// Evaluates the block in the order of Emitter::emitOperation. If a part of it can be computed the block is
+// rebuilt as nested blocks of one operator each, so the emitted postfix order stays the same.
+Value* Optimizer::foldBlock(ValueBlock *block) {
+   int foldedBefore = this->folded;
+   vector<Value*> operands;
+   vector<Operator> operators;
+   int negations = 0;
+
+   auto reduce = [&]() {
+      Value *second = operands.back();
+      operands.pop_back();
+      operands.back() = this->foldOperator(operators.back(), operands.back(), second, block);
+      operators.pop_back();
+   };
+
+   for(variant<Value*, Operator> &element : *(block->getContent())) {
+      if(holds_alternative<Value*>(element)) {
+         element = this->fold(get<Value*>(element));
+         operands.push_back(get<Value*>(element));
+         for(; negations > 0; negations--) {
+            operands.back() = this->foldNot(operands.back(), block);
+         }
+         continue;
+      }
+
+      Operator op = get<Operator>(element);
+      if(op == Operator::Not) {
+         negations++;
+         continue;
+      }
+      while(!operators.empty() && precedence(operators.back()) >= precedence(op)) {
+         reduce();
+      }
+      operators.push_back(op);
+   }
+   while(!operators.empty()) {
+      reduce();
+   }
+
+   if(this->folded == foldedBefore || operands.size() != 1) {
+      return block;
+   }
+   return operands.back();
+}
+
+Value* Optimizer::foldOperator(Operator op, Value *first, Value *second, Value *location) {
+   if(first->getOperandType() == OperandType::Primitive && second->getOperandType() == OperandType::Primitive) {
+      Value *value = this->compute(op, static_cast<ValuePrimitive*>(first)->getConstant(), static_cast<ValuePrimitive*>(second)->getConstant());
+      if(value != nullptr) {
+         this->folded++;
+         value->locate(location);
+         return value;
+      }
+   }
+
+   ValueBlock *block = new ValueBlock();
+   block->locate(location);
+   block->addElement(first);
+   block->addElement(op);
+   block->addElement(second);
+   return block;
+}
+
+Value* Optimizer::foldNot(Value *value, Value *location) {
+   if(value->getOperandType() == OperandType::Primitive && static_cast<ValuePrimitive*>(value)->getConstant()->type == TypeCode::Bool) {
+      this->folded++;
+      Value *negated = new ValuePrimitive(Type(BaseType::Bool), constantOf(TypeCode::Bool, !this->isBool(value, true), 1));
+      negated->locate(location);
+      return negated;
+   }
+
+   ValueBlock *block = new ValueBlock();
+   block->locate(location);
+   block->addElement(Operator::Not);
+   block->addElement(value);
+   return block;
+}
+
+// The result of a operator b as the runtime computes it, nullptr if it can't be known at compile time (strings,
+// mixed bools and numbers, integer division by zero)
+Value* Optimizer::compute(Operator op, Constant *first, Constant *second) {
+   auto boolean = [](bool value) {
+      return new ValuePrimitive(Type(BaseType::Bool), constantOf(TypeCode::Bool, value, 1));
+   };
+
+   if(first->type == TypeCode::Bool && second->type == TypeCode::Bool) {
+      bool a = first->data[0] != 0;
+      bool b = second->data[0] != 0;
+      switch(op) {
+         case Operator::And: return boolean(a && b);
+         case Operator::Or: return boolean(a || b);
+         case Operator::Equal: return boolean(a == b);
+         default: return nullptr;
+      }
+   }
+
+   TypeCode type = promote(first->type, second->type);
+   if(type == TypeCode::Void || op == Operator::And || op == Operator::Or) {
+      return nullptr;
+   }
+
+   if(type == TypeCode::Float || type == TypeCode::Double) {
+      double a = type == TypeCode::Float ? numberOf<float>(first) : numberOf<double>(first);
+      double b = type == TypeCode::Float ? numberOf<float>(second) : numberOf<double>(second);
+      double value;
+      switch(op) {
+         case Operator::Equal: return boolean(a == b);
+         case Operator::Smaller: return boolean(a < b);
+         case Operator::Greater: return boolean(a > b);
+         case Operator::Add: value = a + b; break;
+         case Operator::Sub: value = a - b; break;
+         case Operator::Mul: value = a * b; break;
+         default: value = a / b; break;
+      }
+
+      uint64_t bits = 0;
+      if(type == TypeCode::Float) {
+         float single = static_cast<float>(value);
+         memcpy(&bits, &single, sizeof(single));
+         return new ValuePrimitive(Type(BaseType::Float), constantOf(TypeCode::Float, bits, 4));
+      }
+      memcpy(&bits, &value, sizeof(value));
+      return new ValuePrimitive(Type(BaseType::Double), constantOf(TypeCode::Double, bits, 8));
+   }
+
+   // Integers wrap around, computed unsigned so an overflow isn't undefined here
+   int64_t a = integerOf(first);
+   int64_t b = integerOf(second);
+   uint64_t value;
+   switch(op) {
+      case Operator::Equal: return boolean(a == b);
+      case Operator::Smaller: return boolean(a < b);
+      case Operator::Greater: return boolean(a > b);
+      case Operator::Add: value = static_cast<uint64_t>(a) + static_cast<uint64_t>(b); break;
+      case Operator::Sub: value = static_cast<uint64_t>(a) - static_cast<uint64_t>(b); break;
+      case Operator::Mul: value = static_cast<uint64_t>(a) * static_cast<uint64_t>(b); break;
+      default:
+         if(b == 0 || (a == INT64_MIN && b == -1)) {
+            return nullptr;
+         }
+         value = a / b;
+         break;
+   }
+   if(type == TypeCode::Int) {
+      return new ValuePrimitive(Type(BaseType::Int), constantOf(TypeCode::Int, value, 4));
+   }
+   return new ValuePrimitive(Type(BaseType::Long), constantOf(TypeCode::Long, value, 8));
+}
+
+bool Optimizer::isBool(Value *value, bool expected) {
+   if(value->getOperandType() != OperandType::Primitive) {
+      return false;
+   }
+   Constant *constant = static_cast<ValuePrimitive*>(value)->getConstant();
+   return constant->type == TypeCode::Bool && (constant->data[0] != 0) == expected;
+}
+
+// Type both numbers are computed in: byte, char and short compute as int, then int < long < float < double.
+// Void if one of them isn't a number.
+TypeCode promote(TypeCode first, TypeCode second) {
+   auto rank = [](TypeCode type) {
+      switch(type) {
+         case TypeCode::Byte: case TypeCode::Char: case TypeCode::Short: case TypeCode::Int: return 1;
+         case TypeCode::Long: return 2;
+         case TypeCode::Float: return 3;
+         case TypeCode::Double: return 4;
+         default: return 0;
+      }
+   };
+
+   const TypeCode types[] = { TypeCode::Void, TypeCode::Int, TypeCode::Long, TypeCode::Float, TypeCode::Double };
+   if(rank(first) == 0 || rank(second) == 0) {
+      return TypeCode::Void;
+   }
+   return types[max(rank(first), rank(second))];
+}
+
+// Value of an integer constant, byte, short, int and long are signed, char is not
+int64_t integerOf(Constant *constant) {
+   uint64_t bits = 0;
+   for(size_t i = 0; i < constant->data.length(); i++) {
+      bits |= static_cast<uint64_t>(static_cast<uint8_t>(constant->data[i])) << (8 * i);
+   }
+   int unused = 64 - 8 * constant->data.length();
+   if(constant->type == TypeCode::Char || unused == 0) {
+      return static_cast<int64_t>(bits);
+   }
+   return static_cast<int64_t>(bits << unused) >> unused;
+}
+
+template<typename T> T numberOf(Constant *constant) {
+   if(constant->type == TypeCode::Float) {
+      float value;
+      memcpy(&value, constant->data.data(), sizeof(value));
+      return static_cast<T>(value);
+   } else if(constant->type == TypeCode::Double) {
+      double value;
+      memcpy(&value, constant->data.data(), sizeof(value));
+      return static_cast<T>(value);
+   }
+   return static_cast<T>(integerOf(constant));
+}
+
+/* translate */
+
+// Function 0 is the top level code, the other functions are numbered in source order, lambdas included
+Emitter::Emitter(SFunction *program, bool varints, bool registers, bool typed, bool fuse) {
+   this->varints = varints;
+   this->registers = registers;
+   this->typed = typed;
+   this->fuse = fuse;
+   this->spills = 0;
+   this->typedInstructions = 0;
+   this->fused = 0;
+   this->lastOpcode = Opcode::End;
+   this->lastPosition = 0;
+   this->declarations = 0;
+   this->current = nullptr;
+   this->output = nullptr;
+   this->immediates = 0;
+   this->instructions = 0;
+   this->nextConstant = 0;
+   this->position = 0;
+   this->codeStart = 0;
+   this->addFunction(program);
+   for(Statement *statement : *(program->getStatements())) {
+      this->collect(statement);
+   }
+}
+
+void Emitter::addFunction(SFunction *function) {
+   if(this->functions.size() > UINT16_MAX) {
+      sourceError(function->getOffset(), function->getLength(), "Too many functions, at most 65536 fit into the function table!");
+   }
+   this->functionIndices[function] = this->functions.size();
+   this->functions.push_back({ function, 0, 0, {} });
+}
+
+void Emitter::collect(Statement *statement) {
+   const char *name = statement->getName();
+   if(strcmp(name, "function") == 0) {
+      SFunction *function = static_cast<SFunction*>(statement);
+      if(this->functionNames.count(function->getIdentifier()) > 0) {
+         sourceError(function->getOffset(), function->getLength(), "A function with this name already exists!");
+      }
+      this->functionNames[function->getIdentifier()] = this->functions.size();
+      this->addFunction(function);
+   } else if(strcmp(name, "create") == 0 && static_cast<SCreate*>(statement)->getValue() != nullptr) {
+      this->collect(static_cast<SCreate*>(statement)->getValue());
+   } else if(strcmp(name, "set") == 0) {
+      this->collect(static_cast<SSet*>(statement)->getValue());
+   } else if(strcmp(name, "exit") == 0 || strcmp(name, "return") == 0) {
+      this->collect(static_cast<SResult*>(statement)->getValue());
+   } else if(strcmp(name, "invoke") == 0) {
+      this->collect(static_cast<SInvoke*>(statement)->getChain());
+   } else if(strcmp(name, "if") == 0 || strcmp(name, "while") == 0) {
+      this->collect(static_cast<SCondition*>(statement)->getCondition());
+   } else if(strcmp(name, "for") == 0) {
+      this->collect(static_cast<SFor*>(statement)->getLimit());
+      this->collect(static_cast<SFor*>(statement)->getStep());
+   }
+
+   for(Statement *child : *(statement->getStatements())) {
+      this->collect(child);
+   }
+   if(strcmp(name, "if") == 0 && static_cast<SCondition*>(statement)->getOtherwise() != nullptr) {
+      this->collect(static_cast<SCondition*>(statement)->getOtherwise());
+   }
+}
+
+void Emitter::collect(Value *value) {
+   switch(value->getOperandType()) {
+      case OperandType::Block:
+         for(variant<Value*, Operator> &element : *(static_cast<ValueBlock*>(value)->getContent())) {
+            if(holds_alternative<Value*>(element)) {
+               this->collect(get<Value*>(element));
+            }
+         }
+         break;
+      case OperandType::InvokeChain:
+         for(ValueInvoke *invoke : *(static_cast<ValueInvokeChain*>(value)->getChain())) {
+            for(Value *parameter : *(invoke->getParameters())) {
+               this->collect(parameter);
+            }
+         }
+         break;
+      case OperandType::Array:
+         for(Value *element : *(static_cast<ValueArray*>(value)->getElements())) {
+            this->collect(element);
+         }
+         break;
+      case OperandType::Function: {
+         SFunction *function = static_cast<ValueFunction*>(value)->getFunction();
+         this->addFunction(function);
+         for(Statement *statement : *(function->getStatements())) {
+            this->collect(statement);
+         }
+         break;
+      }
+      default:
+         break;
+   }
+}
+
+size_t Emitter::measure() {
+   this->output = nullptr;
+   this->constants.clear();
+   this->constantPool.clear();
+   this->constantReferences.clear();
+   this->immediates = 0;
+   this->instructions = 0;
+   this->typedInstructions = 0;
+   this->fused = 0;
+   this->spills = 0;
+   this->nextConstant = 0;
+
+   size_t size = 4 + 1 + this->fieldSize(bytecodeVersion, 4) + this->fieldSize(this->functions.size(), 4); // rtos, flags, version, function count
+   for(Code &code : this->functions) {
+      code.labels.clear();
+      this->position = 0;
+      this->registers ? this->generateFunction(&code) : this->emitFunction(&code);
+      code.size = this->position;
+      size += 1 + strlen(code.function->getIdentifier()) + 1 + code.function->getParameters()->size() + this->fieldSize(code.locals, 2) + this->fieldSize(code.depth, 2) + this->fieldSize(code.size, 4) + code.size;
+   }
+   size += this->fieldSize(this->constants.size(), 4);
+   for(size_t i = 0; i < this->constants.size(); i++) {
+      size += this->fieldSize(i, 8) + 1 + this->fieldSize(this->constants[i].data.length(), 4) + this->constants[i].data.length();
+   }
+   return size;
+}
+
+void Emitter::write(char *output) {
+   this->output = output;
+   this->position = 0;
+   this->nextConstant = 0;
+
+   this->putBytes("rtos", 4);
+   this->put8((this->varints ? varintFields : 0) | (this->registers ? registerCode : 0));
+   this->putField(bytecodeVersion, 4);
+
+   this->putField(this->constants.size(), 4);
+   for(size_t i = 0; i < this->constants.size(); i++) {
+      this->putField(i, 8);
+      this->put8(static_cast<uint8_t>(this->constants[i].type));
+      this->putField(this->constants[i].data.length(), 4);
+      this->putBytes(this->constants[i].data.data(), this->constants[i].data.length());
+   }
+
+   this->putField(this->functions.size(), 4);
+   for(Code &code : this->functions) {
+      const char *identifier = code.function->getIdentifier();
+      this->put8(strlen(identifier));
+      this->putBytes(identifier, strlen(identifier));
+      this->put8(code.function->getParameters()->size());
+      for(Variable &parameter : *(code.function->getParameters())) {
+         this->put8(static_cast<uint8_t>(typeCodeOf(parameter.getType())));
+      }
+      this->putField(code.locals, 2);
+      this->putField(code.depth, 2);
+      this->putField(code.size, 4);
+      this->registers ? this->generateFunction(&code) : this->emitFunction(&code);
+   }
+   this->output = nullptr;
+}
+
+// Every local gets the type of the values assigned to it, Void if they differ. The assignments depend on each other
+// (set total to total + i), so the statements are walked until the types don't change anymore. The parameters
+// have their declared types, the runtime converts the arguments to them.
+void Emitter::inferTypes(Code *code) {
+   this->localTypes.clear();
+   this->typesChanged = this->typed;
+   while(this->typesChanged) {
+      this->typesChanged = false;
+      this->locals.clear();
+      this->bindings.clear();
+      this->scopes.clear();
+      this->nextSlot = 0;
+      this->declarations = 0;
+
+      for(Variable &parameter : *(code->function->getParameters())) {
+         this->declare(parameter.getIdentifier(), code->function);
+         TypeCode type = typeCodeOf(parameter.getType());
+         this->assign(this->locals.back().declaration, type == TypeCode::Bool || promote(type, type) != TypeCode::Void ? type : TypeCode::Void);
+      }
+      for(Statement *statement : *(code->function->getStatements())) {
+         this->inferStatement(statement);
+      }
+   }
+}
+
+void Emitter::inferBlock(vector<Statement*> *statements) {
+   this->enterScope();
+   for(Statement *statement : *statements) {
+      this->inferStatement(statement);
+   }
+   this->leaveScope();
+}
+
+// Walks the statements like emitStatement(), so the locals get the same indices
+void Emitter::inferStatement(Statement *statement) {
+   const char *name = statement->getName();
+
+   if(strcmp(name, "create") == 0) {
+      SCreate *create = static_cast<SCreate*>(statement);
+      TypeCode type = create->getValue() != nullptr ? this->typeOf(create->getValue()) : typeCodeOf(*create->getType());
+      this->declare(create->getIdentifier(), create);
+      this->assign(this->locals.back().declaration, type);
+   } else if(strcmp(name, "set") == 0) {
+      SSet *set = static_cast<SSet*>(statement);
+      auto bound = this->bindings.find(set->getIdentifier());
+      if(bound != this->bindings.end()) {
+         this->assign(this->locals[bound->second].declaration, this->typeOf(set->getValue()));
+      }
+   } else if(strcmp(name, "delete") == 0) {
+      auto bound = this->bindings.find(static_cast<SDelete*>(statement)->getIdentifier());
+      if(bound != this->bindings.end()) {
+         this->unbind(bound->second);
+      }
+   } else if(strcmp(name, "increment") == 0 || strcmp(name, "decrement") == 0) {
+      SStep *step = static_cast<SStep*>(statement);
+      auto bound = this->bindings.find(step->getIdentifier());
+      if(bound != this->bindings.end()) {
+         this->assign(this->locals[bound->second].declaration, promote(this->localType(step->getIdentifier()), TypeCode::Int));
+      }
+   } else if(strcmp(name, "if") == 0) {
+      for(Statement *branch = statement; branch != nullptr; branch = static_cast<SCondition*>(branch)->getOtherwise()) {
+         if(strcmp(branch->getName(), "if") != 0) {
+            this->inferBlock(branch->getStatements());
+            break;
+         }
+         this->inferBlock(branch->getStatements());
+      }
+   } else if(strcmp(name, "while") == 0 || strcmp(name, "block") == 0) {
+      this->inferBlock(statement->getStatements());
+   } else if(strcmp(name, "for") == 0) {
+      SFor *loop = static_cast<SFor*>(statement);
+      this->enterScope();
+      this->declare(loop->getCounter(), loop);
+      int counter = this->locals.back().declaration;
+      this->assign(counter, TypeCode::Int);
+      this->inferBlock(loop->getStatements());
+      this->assign(counter, promote(this->localType(loop->getCounter()), this->typeOf(loop->getStep())));
+      this->leaveScope();
+   }
+}
+
+// Joins the type with the ones assigned before
+void Emitter::assign(int declaration, TypeCode type) {
+   if(declaration >= static_cast<int>(this->localTypes.size())) {
+      this->localTypes.resize(declaration + 1, -1);
+   }
+   int known = this->localTypes[declaration];
+   int joined = known < 0 || known == static_cast<int>(type) ? static_cast<int>(type) : static_cast<int>(TypeCode::Void);
+   if(joined != known) {
+      this->localTypes[declaration] = joined;
+      this->typesChanged = true;
+   }
+}
+
+// Static type of a value, Void if it isn't known
+TypeCode Emitter::typeOf(Value *value) {
+   switch(value->getOperandType()) {
+      case OperandType::Primitive:
+         return static_cast<ValuePrimitive*>(value)->getConstant()->type;
+      case OperandType::Identifier: {
+         const char *identifier = static_cast<ValueIdentifier*>(value)->getName();
+         if(this->bindings.find(identifier) == this->bindings.end()) {
+            return this->findFunction(identifier) < 0 ? TypeCode::Void : TypeCode::Function;
+         }
+         return this->localType(identifier);
+      }
+      case OperandType::Block: {
+         vector<Operator> operators;
+         vector<TypeCode> types;
+         bool negated = false;
+         for(variant<Value*, Operator> &element : *(static_cast<ValueBlock*>(value)->getContent())) {
+            if(holds_alternative<Value*>(element)) {
+               types.push_back(negated ? TypeCode::Bool : this->typeOf(get<Value*>(element)));
+               negated = false;
+               continue;
+            }
+            Operator op = get<Operator>(element);
+            if(op == Operator::Not) {
+               negated = true;
+               continue;
+            }
+            while(!operators.empty() && precedence(operators.back()) >= precedence(op)) {
+               TypeCode second = types.back();
+               types.pop_back();
+               types.back() = resultOf(operators.back(), types.back(), second);
+               operators.pop_back();
+            }
+            operators.push_back(op);
+         }
+         while(!operators.empty()) {
+            TypeCode second = types.back();
+            types.pop_back();
+            types.back() = resultOf(operators.back(), types.back(), second);
+            operators.pop_back();
+         }
+         return types.empty() ? TypeCode::Void : types.back();
+      }
+      case OperandType::Function:
+         return TypeCode::Function;
+      case OperandType::Array:
+         return TypeCode::Array;
+      default:
+         return TypeCode::Void;
+   }
+}
+
+TypeCode Emitter::localType(const char *identifier) {
+   auto bound = this->bindings.find(identifier);
+   if(bound == this->bindings.end()) {
+      return TypeCode::Void;
+   }
+   int declaration = this->locals[bound->second].declaration;
+   if(declaration >= static_cast<int>(this->localTypes.size()) || this->localTypes[declaration] < 0) {
+      return TypeCode::Void;
+   }
+   return static_cast<TypeCode>(this->localTypes[declaration]);
+}
+
+// Without typed instructions every operation gets the generic one
+Opcode Emitter::select(Operator op, TypeCode first, TypeCode second) {
+   return this->typed ? opcodeOf(op, first, second) : opcodeOf(op, TypeCode::Void, TypeCode::Void);
+}
+
+// The parameters are the first locals, a function without return ends with a void result
+void Emitter::emitFunction(Code *code) {
+   this->current = code;
+   this->codeStart = this->position;
+   this->lastOpcode = Opcode::End;
+   code->depth = 0;
+   this->depth = 0;
+   this->inferTypes(code);
+   this->locals.clear();
+   this->bindings.clear();
+   this->scopes.clear();
+   this->nextSlot = 0;
+   this->nextLabel = 0;
+   this->declarations = 0;
+
+   if(code->function->getParameters()->size() > UINT8_MAX) {
+      sourceError(code->function->getOffset(), code->function->getLength(), "Too many parameters, a function takes at most 255!");
+   }
+   for(Variable &parameter : *(code->function->getParameters())) {
+      this->declare(parameter.getIdentifier(), code->function);
+   }
+   for(Statement *statement : *(code->function->getStatements())) {
+      this->emitStatement(statement);
+   }
+   this->emit(Opcode::End);
+   code->locals = max(code->locals, this->nextSlot);
+   if(code->depth > UINT16_MAX) {
+      sourceError(code->function->getOffset(), code->function->getLength(), "Too deeply nested, a function holds at most 65535 operands!");
+   }
+}
+
+void Emitter::emitBlock(vector<Statement*> *statements) {
+   this->enterScope();
+   for(Statement *statement : *statements) {
+      this->emitStatement(statement);
+   }
+   this->leaveScope();
+}
+
+void Emitter::emitStatement(Statement *statement) {
+   const char *name = statement->getName();
+
+   if(strcmp(name, "create") == 0) {
+      SCreate *create = static_cast<SCreate*>(statement);
+      if(create->getValue() != nullptr) {
+         this->emitValue(create->getValue()); // before the declaration, the value may refer to a shadowed variable
+         this->emitSlot(Opcode::Set, this->declare(create->getIdentifier(), create));
+      } else {
+         Type *type = create->getType();
+         this->emitSlot(Opcode::Create, this->declare(create->getIdentifier(), create));
+         this->put8(static_cast<uint8_t>(typeCodeOf(*type)));
+      }
+   } else if(strcmp(name, "set") == 0) {
+      SSet *set = static_cast<SSet*>(statement);
+      int slot = this->findLocal(set->getIdentifier(), set);
+      this->emitValue(set->getValue());
+      this->emitSlot(Opcode::Set, slot);
+   } else if(strcmp(name, "delete") == 0) {
+      SDelete *deletion = static_cast<SDelete*>(statement);
+      int slot = this->findLocal(deletion->getIdentifier(), deletion);
+      this->emitSlot(Opcode::Delete, slot);
+      this->unbind(this->bindings[deletion->getIdentifier()]);
+   } else if(strcmp(name, "increment") == 0 || strcmp(name, "decrement") == 0) {
+      SStep *step = static_cast<SStep*>(statement);
+      int slot = this->findLocal(step->getIdentifier(), step);
+      Operator op = strcmp(name, "increment") == 0 ? Operator::Add : Operator::Sub;
+      if(this->fuse && this->select(op, this->localType(step->getIdentifier()), TypeCode::Int) == (op == Operator::Add ? Opcode::AddInt : Opcode::SubInt)) {
+         this->emitSlot(op == Operator::Add ? Opcode::IncrementInt : Opcode::DecrementInt, slot);
+         this->fused += 3 * (this->output == nullptr); // push, push, add.i32 and set are one
+      } else {
+         this->emit(Opcode::Push);
+         this->emitOperand(PointerType::STACK, slot);
+         this->emitConstant(constantOf(TypeCode::Int, 1, 4));
+         this->emitOperator(op, this->localType(step->getIdentifier()), TypeCode::Int);
+         this->emitSlot(Opcode::Set, slot);
+      }
+   } else if(strcmp(name, "exit") == 0) {
+      this->emitValue(static_cast<SResult*>(statement)->getValue());
+      this->emit(Opcode::Exit);
+   } else if(strcmp(name, "return") == 0) {
+      this->emitValue(static_cast<SResult*>(statement)->getValue());
+      this->emit(Opcode::Return);
+   } else if(strcmp(name, "invoke") == 0) {
+      this->emitInvoke(static_cast<SInvoke*>(statement)->getChain());
+      this->emit(Opcode::Pop);
+   } else if(strcmp(name, "if") == 0) {
+      this->emitCondition(static_cast<SCondition*>(statement));
+   } else if(strcmp(name, "while") == 0) {
+      this->emitWhile(static_cast<SCondition*>(statement));
+   } else if(strcmp(name, "for") == 0) {
+      this->emitFor(static_cast<SFor*>(statement));
+   } else if(strcmp(name, "block") == 0) { // the body of a branch the optimizer found to be always taken
+      this->emitBlock(statement->getStatements());
+   } else if(strcmp(name, "function") != 0) { // functions have their own entry in the function table
+      compilerError("Compiler error: Unknown statement!");
+   }
+}
+
+void Emitter::emitCondition(SCondition *condition) {
+   int skip = this->newLabel();
+   this->emitValue(condition->getCondition());
+   this->emitJumpUnless(skip);
+   this->emitBlock(condition->getStatements());
+
+   Statement *otherwise = condition->getOtherwise();
+   if(otherwise == nullptr) {
+      this->place(skip);
+      return;
+   }
+
+   int end = this->newLabel();
+   this->emitJump(Opcode::Jump, end);
+   this->place(skip);
+   if(strcmp(otherwise->getName(), "if") == 0) {
+      this->emitCondition(static_cast<SCondition*>(otherwise));
+   } else {
+      this->emitBlock(otherwise->getStatements());
+   }
+   this->place(end);
+}
+
+void Emitter::emitWhile(SCondition *loop) {
+   int start = this->newLabel();
+   int end = this->newLabel();
+   this->place(start);
+   this->emitValue(loop->getCondition());
+   this->emitJumpUnless(end);
+   this->emitBlock(loop->getStatements());
+   this->emitJump(Opcode::Jump, start);
+   this->place(end);
+}
+
+// The counter lives in a scope around the loop, an unnamed counter can't be referred to
+void Emitter::emitFor(SFor *loop) {
+   int start = this->newLabel();
+   int end = this->newLabel();
+   this->enterScope();
+   int counter = this->declare(loop->getCounter(), loop);
+
+   this->emitConstant(constantOf(TypeCode::Int, 0, 4));
+   this->emitSlot(Opcode::Set, counter);
+   if(this->isCounted(loop)) {
+      uint8_t mode = loop->isAbove() | loop->isDown() << 1;
+      this->emitSlot(Opcode::LoopInt, counter);
+      this->emitInvariant(loop->getLimit());
+      this->put8(mode);
+      this->putTarget(end);
+      this->place(start);
+      this->emitBlock(loop->getStatements());
+      this->emitSlot(Opcode::NextInt, counter);
+      this->emitInvariant(loop->getLimit());
+      this->emitInvariant(loop->getStep());
+      this->put8(mode);
+      this->putTarget(start);
+      this->place(end);
+      this->leaveScope();
+      return;
+   }
+
+   TypeCode counterType = this->localType(loop->getCounter());
+   this->place(start);
+   this->emit(Opcode::Push);
+   this->emitOperand(PointerType::STACK, counter);
+   TypeCode limitType = this->emitValue(loop->getLimit());
+   this->emitOperator(loop->isAbove() ? Operator::Greater : Operator::Smaller, counterType, limitType);
+   this->emitJumpUnless(end);
+
+   this->emitBlock(loop->getStatements());
+
+   this->emit(Opcode::Push);
+   this->emitOperand(PointerType::STACK, counter);
+   TypeCode stepType = this->emitValue(loop->getStep());
+   this->emitOperator(loop->isDown() ? Operator::Sub : Operator::Add, counterType, stepType);
+   this->emitSlot(Opcode::Set, counter);
+   this->emitJump(Opcode::Jump, start);
+   this->place(end);
+   this->leaveScope();
+}
+
+// An int counter with a limit and a step that don't change in the loop is counted by loop.i32 and next.i32
+bool Emitter::isCounted(SFor *loop) {
+   return this->fuse && this->localType(loop->getCounter()) == TypeCode::Int && this->isInvariant(loop->getLimit(), loop) && this->isInvariant(loop->getStep(), loop);
+}
+
+bool Emitter::isInvariant(Value *value, SFor *loop) {
+   if(value->getOperandType() == OperandType::Primitive) {
+      return static_cast<ValuePrimitive*>(value)->getConstant()->type == TypeCode::Int;
+   }
+   if(value->getOperandType() != OperandType::Identifier) {
+      return false;
+   }
+   const char *identifier = static_cast<ValueIdentifier*>(value)->getName();
+   return strcmp(identifier, loop->getCounter()) != 0 && this->findLocal(identifier) >= 0 && this->localType(identifier) == TypeCode::Int && !writes(loop->getStatements(), identifier);
+}
+
+// The operand of a literal or a variable, without the push
+void Emitter::emitInvariant(Value *value) {
+   if(value->getOperandType() == OperandType::Primitive) {
+      this->emitConstantOperand(*(static_cast<ValuePrimitive*>(value)->getConstant()));
+   } else {
+      this->emitOperand(PointerType::STACK, this->findLocal(static_cast<ValueIdentifier*>(value)->getName()));
+   }
+}
+
+// Returns the static type of the value, Void if it isn't known
+TypeCode Emitter::emitValue(Value *value) {
+   switch(value->getOperandType()) {
+      case OperandType::Primitive:
+         this->emitConstant(*(static_cast<ValuePrimitive*>(value)->getConstant()));
+         return static_cast<ValuePrimitive*>(value)->getConstant()->type;
+      case OperandType::Identifier: {
+         const char *identifier = static_cast<ValueIdentifier*>(value)->getName();
+         int slot = this->findLocal(identifier);
+         int function = slot < 0 ? this->findFunction(identifier) : -1;
+         if(slot < 0 && function < 0) {
+            sourceError(value->getOffset(), value->getLength(), "Unknown identifier, neither a variable nor a function!");
+         }
+         this->emit(Opcode::Push);
+         this->emitOperand(slot < 0 ? PointerType::FUNCTION : PointerType::STACK, slot < 0 ? function : slot);
+         return slot < 0 ? TypeCode::Function : this->localType(identifier);
+      }
+      case OperandType::Block:
+         return this->emitOperation(static_cast<ValueBlock*>(value));
+      case OperandType::InvokeChain:
+         this->emitInvoke(static_cast<ValueInvokeChain*>(value));
+         return TypeCode::Void;
+      case OperandType::Function:
+         this->emit(Opcode::Push);
+         this->emitOperand(PointerType::FUNCTION, this->functionIndices[static_cast<ValueFunction*>(value)->getFunction()]);
+         return TypeCode::Function;
+      case OperandType::Array: {
+         vector<Value*> *elements = static_cast<ValueArray*>(value)->getElements();
+         if(elements->size() > UINT16_MAX) {
+            sourceError(value->getOffset(), value->getLength(), "Too many elements, an array literal holds at most 65535!");
+         }
+         for(Value *element : *elements) {
+            this->emitValue(element);
+         }
+         this->emit(Opcode::Array);
+         this->put16(elements->size());
+         this->push(1 - static_cast<int>(elements->size()));
+         return TypeCode::Array;
+      }
+      default:
+         compilerError("Compiler error: Unknown value!");
+         return TypeCode::Void;
+   }
+}
+
+int precedence(Operator op) {
+   switch(op) {
+      case Operator::Mul: case Operator::Div: return 4;
+      case Operator::Add: case Operator::Sub: return 3;
+      case Operator::Equal: case Operator::Greater: case Operator::Smaller: return 2;
+      case Operator::And: return 1;
+      default: return 0;
+   }
+}
+
+// Type byte of a declared type, the base types keep their numbers
+TypeCode typeCodeOf(Type type) {
+   return holds_alternative<BaseType>(type.getBaseType()) ? static_cast<TypeCode>(get<BaseType>(type.getBaseType())) : TypeCode::Object;
+}
+
+TypeCode resultOf(Operator op, TypeCode first, TypeCode second) {
+   switch(op) {
+      case Operator::Add: case Operator::Sub: case Operator::Mul: case Operator::Div: return promote(first, second);
+      default: return TypeCode::Bool;
+   }
+}
+
+// The typed instruction if both operands are computed in their own representation: byte, char, short and int as
+// int, integers with a long as long, float and double only with their own type. Bools compare as ints.
+Opcode opcodeOf(Operator op, TypeCode first, TypeCode second) {
+   Opcode generic;
+   switch(op) {
+      case Operator::Add: generic = Opcode::Add; break;
+      case Operator::Sub: generic = Opcode::Sub; break;
+      case Operator::Mul: generic = Opcode::Mul; break;
+      case Operator::Div: generic = Opcode::Div; break;
+      case Operator::Equal: generic = Opcode::Equal; break;
+      case Operator::Smaller: generic = Opcode::Smaller; break;
+      case Operator::Greater: generic = Opcode::Greater; break;
+      case Operator::And: return Opcode::And;
+      case Operator::Or: return Opcode::Or;
+      default: return Opcode::Not;
+   }
+
+   TypeCode type = promote(first, second);
+   int group;
+   if(type == TypeCode::Int || (op == Operator::Equal && first == TypeCode::Bool && second == TypeCode::Bool)) {
+      group = 0;
+   } else if(type == TypeCode::Long) {
+      group = 1;
+   } else if(type == TypeCode::Float && first == second) {
+      group = 2;
+   } else if(type == TypeCode::Double && first == second) {
+      group = 3;
+   } else {
+      return generic;
+   }
+   return static_cast<Opcode>(static_cast<int>(Opcode::AddInt) + 7 * group + static_cast<int>(generic) - static_cast<int>(Opcode::Add));
+}
+
+Opcode registerOf(Opcode opcode) {
+   if(opcode >= Opcode::AddInt) {
+      return static_cast<Opcode>(static_cast<int>(opcode) + static_cast<int>(Opcode::AddIntRegister) - static_cast<int>(Opcode::AddInt));
+   }
+   return static_cast<Opcode>(static_cast<int>(opcode) + static_cast<int>(Opcode::AddRegister) - static_cast<int>(Opcode::Add));
+}
+
+// Entries the stack instruction adds to the operands, invoke and array take their counts from push(). A fused
+// compare jump only pops the condition, the compare before it was counted already.
+int stackEffect(Opcode opcode) {
+   switch(opcode) {
+      case Opcode::Push:
+         return 1;
+      case Opcode::Pop:
+      case Opcode::Set:
+      case Opcode::JumpUnless:
+      case Opcode::JumpUnlessEqualInt:
+      case Opcode::JumpUnlessSmallerInt:
+      case Opcode::JumpUnlessGreaterInt:
+      case Opcode::Return:
+      case Opcode::Exit:
+         return -1;
+      default:
+         return (opcode >= Opcode::Add && opcode <= Opcode::Or) || (opcode >= Opcode::AddInt && opcode <= Opcode::GreaterDouble) ? -1 : 0;
+   }
+}
+
+// Whether a statement of the block sets, steps or deletes the variable, nested blocks included
+bool writes(vector<Statement*> *statements, const char *identifier) {
+   if(statements == nullptr) {
+      return false;
+   }
+   for(Statement *statement : *statements) {
+      const char *name = statement->getName();
+      const char *written = nullptr;
+      if(strcmp(name, "set") == 0) {
+         written = static_cast<SSet*>(statement)->getIdentifier();
+      } else if(strcmp(name, "delete") == 0) {
+         written = static_cast<SDelete*>(statement)->getIdentifier();
+      } else if(strcmp(name, "increment") == 0 || strcmp(name, "decrement") == 0) {
+         written = static_cast<SStep*>(statement)->getIdentifier();
+      } else if(strcmp(name, "if") == 0) {
+         for(Statement *branch = statement; branch != nullptr; branch = static_cast<SCondition*>(branch)->getOtherwise()) {
+            if(writes(branch->getStatements(), identifier)) {
+               return true;
+            }
+            if(strcmp(branch->getName(), "if") != 0) {
+               break;
+            }
+         }
+         continue;
+      }
+      if((written != nullptr && strcmp(written, identifier) == 0) || (strcmp(name, "function") != 0 && written == nullptr && writes(statement->getStatements(), identifier))) {
+         return true;
+      }
+   }
+   return false;
+}
+
+// Infix to postfix: * and / bind stronger than + and -, those stronger than comparisons, then && and ||.
+// Negations apply to the operand right after them.
+TypeCode Emitter::emitOperation(ValueBlock *block) {
+   vector<Operator> operators;
+   vector<TypeCode> types;
+   int negations = 0;
+   auto reduce = [&]() {
+      TypeCode second = types.back();
+      types.pop_back();
+      types.back() = this->emitOperator(operators.back(), types.back(), second);
+      operators.pop_back();
+   };
+
+   for(variant<Value*, Operator> &element : *(block->getContent())) {
+      if(holds_alternative<Value*>(element)) {
+         types.push_back(this->emitValue(get<Value*>(element)));
+         for(; negations > 0; negations--) {
+            types.back() = this->emitOperator(Operator::Not, types.back(), types.back());
+         }
+         continue;
+      }
+
+      Operator op = get<Operator>(element);
+      if(op == Operator::Not) {
+         negations++;
+         continue;
+      }
+      while(!operators.empty() && precedence(operators.back()) >= precedence(op)) {
+         reduce();
+      }
+      operators.push_back(op);
+   }
+
+   while(!operators.empty()) {
+      reduce();
+   }
+   return types.back();
+}
+
+// Emits the instruction for the operand types and returns the type of the result
+TypeCode Emitter::emitOperator(Operator op, TypeCode first, TypeCode second) {
+   this->emit(this->select(op, first, second));
+   return resultOf(op, first, second);
+}
+
+// A domain that isn't a variable names native functions (env::print), the runtime finds them by name. A variable in
+// front of the chain is the first argument of the first call, every further call gets the previous result first.
+void Emitter::emitInvoke(ValueInvokeChain *chain) {
+   ValueInvoke *first = chain->getChain()->at(0);
+   const char *space = first->getSpace().getName();
+   int receiver = space != nullptr ? this->findLocal(space) : -1;
+   int carried = 0;
+
+   if(receiver >= 0) {
+      this->emit(Opcode::Push);
+      this->emitOperand(PointerType::STACK, receiver);
+      carried = 1;
+   }
+
+   for(ValueInvoke *invoke : *(chain->getChain())) {
+      for(Value *parameter : *(invoke->getParameters())) {
+         this->emitValue(parameter);
+      }
+      int argumentCount = carried + invoke->getParameters()->size();
+      if(argumentCount > UINT8_MAX) {
+         sourceError(invoke->getOffset(), invoke->getLength(), "Too many arguments, a function takes at most 255!");
+      }
+
+      const char *identifier = invoke->getName().getName();
+      if(invoke == first && space != nullptr && receiver < 0) {
+         int index = this->addConstant({ TypeCode::String, string(space) + "::" + identifier });
+         this->emit(Opcode::Invoke);
+         this->emitOperand(PointerType::CONSTANT, index);
+      } else {
+         int function = this->findFunction(identifier);
+         int slot = function < 0 ? this->findLocal(identifier) : -1;
+         if(function < 0 && slot < 0) {
+            sourceError(invoke->getOffset(), invoke->getLength(), "Unknown function!");
+         }
+         this->emit(Opcode::Invoke);
+         this->emitOperand(function < 0 ? PointerType::STACK : PointerType::FUNCTION, function < 0 ? slot : function);
+      }
+      this->put8(argumentCount);
+      this->push(1 - argumentCount);
+      carried = 1;
+   }
+}
+
+// The register variant generates three address code on temporaries first, linearScan() gives the temporaries the
+// registers behind the locals and encode() writes the code. The statements are visited like for the stack code.
+void Emitter::generateFunction(Code *code) {
+   this->current = code;
+   this->codeStart = this->position;
+   code->locals = 0;
+   code->depth = 0;
+   this->inferTypes(code);
+   this->locals.clear();
+   this->bindings.clear();
+   this->scopes.clear();
+   this->code.clear();
+   this->nextSlot = 0;
+   this->nextLabel = 0;
+   this->declarations = 0;
+   this->nextTemporary = 0;
+
+   if(code->function->getParameters()->size() > UINT8_MAX) {
+      sourceError(code->function->getOffset(), code->function->getLength(), "Too many parameters, a function takes at most 255!");
+   }
+   for(Variable &parameter : *(code->function->getParameters())) {
+      this->declare(parameter.getIdentifier(), code->function);
+   }
+   for(Statement *statement : *(code->function->getStatements())) {
+      this->generateStatement(statement);
+   }
+   this->add(Opcode::End, {});
+
+   this->linearScan(max(code->locals, this->nextSlot));
+   this->encode();
+}
+
+void Emitter::generateBlock(vector<Statement*> *statements) {
+   this->enterScope();
+   for(Statement *statement : *statements) {
+      this->generateStatement(statement);
+   }
+   this->leaveScope();
+}
+
+void Emitter::generateStatement(Statement *statement) {
+   const char *name = statement->getName();
+
+   if(strcmp(name, "create") == 0) {
+      SCreate *create = static_cast<SCreate*>(statement);
+      if(create->getValue() != nullptr) {
+         Operand target { PointerType::STACK, this->nextSlot, false }; // the slot declare() hands out next
+         Operand value = this->generateValue(create->getValue(), &target);
+         this->declare(create->getIdentifier(), create);
+         if(value.type != target.type || value.index != target.index || value.temporary) {
+            this->add(Opcode::Move, { target, value });
+         }
+      } else {
+         Type *type = create->getType();
+         int slot = this->declare(create->getIdentifier(), create);
+         this->add(Opcode::Create, { { PointerType::STACK, slot, false } }, -1, static_cast<uint8_t>(typeCodeOf(*type)));
+      }
+   } else if(strcmp(name, "set") == 0) {
+      SSet *set = static_cast<SSet*>(statement);
+      Operand target { PointerType::STACK, this->findLocal(set->getIdentifier(), set), false };
+      Operand value = this->generateValue(set->getValue(), &target);
+      if(value.type != target.type || value.index != target.index || value.temporary) {
+         this->add(Opcode::Move, { target, value });
+      }
+   } else if(strcmp(name, "delete") == 0) {
+      SDelete *deletion = static_cast<SDelete*>(statement);
+      this->add(Opcode::Delete, { { PointerType::STACK, this->findLocal(deletion->getIdentifier(), deletion), false } });
+      this->unbind(this->bindings[deletion->getIdentifier()]);
+   } else if(strcmp(name, "increment") == 0 || strcmp(name, "decrement") == 0) {
+      SStep *step = static_cast<SStep*>(statement);
+      Operand variable { PointerType::STACK, this->findLocal(step->getIdentifier(), step), false };
+      Opcode opcode = this->select(strcmp(name, "increment") == 0 ? Operator::Add : Operator::Sub, this->localType(step->getIdentifier()), TypeCode::Int);
+      this->add(registerOf(opcode), { variable, variable, this->generateConstant(constantOf(TypeCode::Int, 1, 4)) });
+   } else if(strcmp(name, "exit") == 0) {
+      this->add(Opcode::ExitRegister, { this->generateValue(static_cast<SResult*>(statement)->getValue(), nullptr) });
+   } else if(strcmp(name, "return") == 0) {
+      this->add(Opcode::ReturnRegister, { this->generateValue(static_cast<SResult*>(statement)->getValue(), nullptr) });
+   } else if(strcmp(name, "invoke") == 0) {
+      this->generateInvoke(static_cast<SInvoke*>(statement)->getChain());
+   } else if(strcmp(name, "if") == 0) {
+      this->generateCondition(static_cast<SCondition*>(statement));
+   } else if(strcmp(name, "while") == 0) {
+      this->generateWhile(static_cast<SCondition*>(statement));
+   } else if(strcmp(name, "for") == 0) {
+      this->generateFor(static_cast<SFor*>(statement));
+   } else if(strcmp(name, "block") == 0) {
+      this->generateBlock(statement->getStatements());
+   } else if(strcmp(name, "function") != 0) {
+      compilerError("Compiler error: Unknown statement!");
+   }
+}
+
+void Emitter::generateCondition(SCondition *condition) {
+   int skip = this->newLabel();
+   this->addJumpUnless(this->generateValue(condition->getCondition(), nullptr), skip);
+   this->generateBlock(condition->getStatements());
+
+   Statement *otherwise = condition->getOtherwise();
+   if(otherwise == nullptr) {
+      this->addLabel(skip);
+      return;
+   }
+
+   int end = this->newLabel();
+   this->add(Opcode::Jump, {}, end);
+   this->addLabel(skip);
+   if(strcmp(otherwise->getName(), "if") == 0) {
+      this->generateCondition(static_cast<SCondition*>(otherwise));
+   } else {
+      this->generateBlock(otherwise->getStatements());
+   }
+   this->addLabel(end);
+}
+
+void Emitter::generateWhile(SCondition *loop) {
+   int start = this->newLabel();
+   int end = this->newLabel();
+   this->addLabel(start);
+   this->addJumpUnless(this->generateValue(loop->getCondition(), nullptr), end);
+   this->generateBlock(loop->getStatements());
+   this->add(Opcode::Jump, {}, start);
+   this->addLabel(end);
+}
+
+void Emitter::generateFor(SFor *loop) {
+   int start = this->newLabel();
+   int end = this->newLabel();
+   this->enterScope();
+   Operand counter { PointerType::STACK, this->declare(loop->getCounter(), loop), false, this->localType(loop->getCounter()) };
+
+   this->add(Opcode::Move, { counter, this->generateConstant(constantOf(TypeCode::Int, 0, 4)) });
+   if(this->isCounted(loop)) {
+      int mode = loop->isAbove() | loop->isDown() << 1;
+      Operand limit = this->generateValue(loop->getLimit(), nullptr);
+      Operand step = this->generateValue(loop->getStep(), nullptr);
+      this->add(Opcode::LoopInt, { counter, limit }, end, mode);
+      this->addLabel(start);
+      this->generateBlock(loop->getStatements());
+      this->add(Opcode::NextInt, { counter, limit, step }, start, mode);
+      this->addLabel(end);
+      this->leaveScope();
+      return;
+   }
+
+   this->addLabel(start);
+   Operand limit = this->generateValue(loop->getLimit(), nullptr);
+   Operand test = this->temporary();
+   this->add(registerOf(this->select(loop->isAbove() ? Operator::Greater : Operator::Smaller, counter.staticType, limit.staticType)), { test, counter, limit });
+   this->addJumpUnless(test, end);
+
+   this->generateBlock(loop->getStatements());
+
+   Operand step = this->generateValue(loop->getStep(), nullptr);
+   this->add(registerOf(this->select(loop->isDown() ? Operator::Sub : Operator::Add, counter.staticType, step.staticType)), { counter, counter, step });
+   this->add(Opcode::Jump, {}, start);
+   this->addLabel(end);
+   this->leaveScope();
+}
+
+// Literals, variables and functions are operands themselves, everything else is computed into a temporary. With
+// a target (the variable that is set) the last instruction writes its result there instead.
+Emitter::Operand Emitter::generateValue(Value *value, const Operand *target) {
+   Operand result;
+   switch(value->getOperandType()) {
+      case OperandType::Primitive:
+         return this->generateConstant(*(static_cast<ValuePrimitive*>(value)->getConstant()));
+      case OperandType::Identifier: {
+         const char *identifier = static_cast<ValueIdentifier*>(value)->getName();
+         int slot = this->findLocal(identifier);
+         int function = slot < 0 ? this->findFunction(identifier) : -1;
+         if(slot < 0 && function < 0) {
+            sourceError(value->getOffset(), value->getLength(), "Unknown identifier, neither a variable nor a function!");
+         }
+         return { slot < 0 ? PointerType::FUNCTION : PointerType::STACK, slot < 0 ? function : slot, false, slot < 0 ? TypeCode::Function : this->localType(identifier) };
+      }
+      case OperandType::Function:
+         return { PointerType::FUNCTION, this->functionIndices[static_cast<ValueFunction*>(value)->getFunction()], false, TypeCode::Function };
+      case OperandType::Block:
+         result = this->generateOperation(static_cast<ValueBlock*>(value));
+         break;
+      case OperandType::InvokeChain:
+         result = this->generateInvoke(static_cast<ValueInvokeChain*>(value));
+         break;
+      case OperandType::Array: {
+         vector<Value*> *elements = static_cast<ValueArray*>(value)->getElements();
+         if(elements->size() > UINT16_MAX) {
+            sourceError(value->getOffset(), value->getLength(), "Too many elements, an array literal holds at most 65535!");
+         }
+         vector<Operand> operands(1);
+         for(Value *element : *elements) {
+            operands.push_back(this->generateValue(element, nullptr));
+         }
+         result = operands[0] = this->temporary();
+         result.staticType = TypeCode::Array;
+         this->add(Opcode::ArrayRegister, operands, -1, elements->size());
+         break;
+      }
+      default:
+         compilerError("Compiler error: Unknown value!");
+         return {};
+   }
+
+   // Only the instruction that defines the temporary knows it so far (it is the last one)
+   Operand &destination = this->code.back().operands[0];
+   if(target != nullptr && result.temporary && destination.temporary && destination.index == result.index) {
+      destination = *target;
+      destination.staticType = result.staticType;
+      return destination;
+   }
+   return result;
+}
+
+// Same order as emitOperation(), every operator gets a temporary for its result
+Emitter::Operand Emitter::generateOperation(ValueBlock *block) {
+   vector<Operand> operands;
+   vector<Operator> operators;
+   int negations = 0;
+   auto reduce = [&]() {
+      Operand second = operands.back();
+      operands.pop_back();
+      Operand result = this->temporary();
+      result.staticType = resultOf(operators.back(), operands.back().staticType, second.staticType);
+      this->add(registerOf(this->select(operators.back(), operands.back().staticType, second.staticType)), { result, operands.back(), second });
+      operands.back() = result;
+      operators.pop_back();
+   };
+
+   for(variant<Value*, Operator> &element : *(block->getContent())) {
+      if(holds_alternative<Value*>(element)) {
+         operands.push_back(this->generateValue(get<Value*>(element), nullptr));
+         for(; negations > 0; negations--) {
+            Operand result = this->temporary();
+            result.staticType = TypeCode::Bool;
+            this->add(Opcode::NotRegister, { result, operands.back() });
+            operands.back() = result;
+         }
+         continue;
+      }
+
+      Operator op = get<Operator>(element);
+      if(op == Operator::Not) {
+         negations++;
+         continue;
+      }
+      while(!operators.empty() && precedence(operators.back()) >= precedence(op)) {
+         reduce();
+      }
+      operators.push_back(op);
+   }
+   while(!operators.empty()) {
+      reduce();
+   }
+   return operands.back();
+}
+
+// Like emitInvoke(), the arguments are operands of the invoke instruction
+Emitter::Operand Emitter::generateInvoke(ValueInvokeChain *chain) {
+   ValueInvoke *first = chain->getChain()->at(0);
+   const char *space = first->getSpace().getName();
+   int receiver = space != nullptr ? this->findLocal(space) : -1;
+   vector<Operand> carried;
+
+   if(receiver >= 0) {
+      carried.push_back({ PointerType::STACK, receiver, false });
+   }
+
+   for(ValueInvoke *invoke : *(chain->getChain())) {
+      vector<Operand> operands(2);
+      operands.insert(operands.end(), carried.begin(), carried.end());
+      for(Value *parameter : *(invoke->getParameters())) {
+         operands.push_back(this->generateValue(parameter, nullptr));
+      }
+      int argumentCount = operands.size() - 2;
+      if(argumentCount > UINT8_MAX) {
+         sourceError(invoke->getOffset(), invoke->getLength(), "Too many arguments, a function takes at most 255!");
+      }
+
+      const char *identifier = invoke->getName().getName();
+      if(invoke == first && space != nullptr && receiver < 0) {
+         operands[1] = { PointerType::CONSTANT, this->addConstant({ TypeCode::String, string(space) + "::" + identifier }), false };
+      } else {
+         int function = this->findFunction(identifier);
+         int slot = function < 0 ? this->findLocal(identifier) : -1;
+         if(function < 0 && slot < 0) {
+            sourceError(invoke->getOffset(), invoke->getLength(), "Unknown function!");
+         }
+         operands[1] = { function < 0 ? PointerType::STACK : PointerType::FUNCTION, function < 0 ? slot : function, false };
+      }
+      operands[0] = this->temporary();
+      this->add(Opcode::InvokeRegister, operands, -1, argumentCount);
+      carried = { operands[0] };
+   }
+   return carried[0];
+}
+
+Emitter::Operand Emitter::generateConstant(Constant constant) {
+   if(constant.type == TypeCode::Int) {
+      int32_t value = 0;
+      for(int i = 0; i < 4; i++) {
+         value |= static_cast<uint8_t>(constant.data[i]) << (8 * i);
+      }
+      if(value >= INT16_MIN && value <= INT16_MAX) {
+         this->immediates += this->output == nullptr;
+         return { PointerType::IMMEDIATE, value, false, TypeCode::Int };
+      }
+   }
+   return { PointerType::CONSTANT, this->addConstant(constant), false, constant.type };
+}
+
+Emitter::Operand Emitter::temporary() {
+   return { PointerType::STACK, this->nextTemporary++, true };
+}
+
+void Emitter::add(Opcode opcode, vector<Operand> operands, int label, int count) {
+   this->code.push_back({ opcode, move(operands), label, count, false });
+}
+
+// A condition computed by an int compare right before is fused with the jump
+void Emitter::addJumpUnless(Operand condition, int label) {
+   Instruction *last = this->code.empty() ? nullptr : &this->code.back();
+   bool compared = last != nullptr && !last->isLabel && (last->opcode == Opcode::EqualIntRegister || last->opcode == Opcode::SmallerIntRegister || last->opcode == Opcode::GreaterIntRegister);
+   if(this->fuse && condition.temporary && compared && last->operands[0].temporary && last->operands[0].index == condition.index) {
+      Opcode opcode = static_cast<Opcode>(static_cast<int>(Opcode::JumpUnlessEqualIntRegister) + static_cast<int>(last->opcode) - static_cast<int>(Opcode::EqualIntRegister));
+      vector<Operand> operands = { last->operands[1], last->operands[2] };
+      this->code.pop_back();
+      this->add(opcode, operands, label);
+      this->fused += this->output == nullptr;
+      return;
+   }
+   this->add(Opcode::JumpUnlessRegister, { condition }, label);
+}
+
+void Emitter::addLabel(int label) {
+   this->code.push_back({ Opcode::End, {}, label, 0, true });
+}
+
+// Linear scan over the live ranges of the temporaries, from their definition to their last use. An instruction
+// reads its operands before it writes its destination, so a register is free again at the last use of its
+// temporary. Without a free register the temporary that lives longest is spilled to a slot behind the registers.
+void Emitter::linearScan(int base) {
+   vector<int> start(this->nextTemporary, -1);
+   vector<int> end(this->nextTemporary, -1);
+   for(size_t i = 0; i < this->code.size(); i++) {
+      for(Operand &operand : this->code[i].operands) {
+         if(operand.temporary) {
+            if(start[operand.index] < 0) {
+               start[operand.index] = i;
+            }
+            end[operand.index] = i;
+         }
+      }
+   }
+
+   vector<int> order(this->nextTemporary);
+   for(int i = 0; i < this->nextTemporary; i++) {
+      order[i] = i;
+   }
+   stable_sort(order.begin(), order.end(), [&start](int a, int b) {
+      return start[a] < start[b];
+   });
+
+   this->assigned.assign(this->nextTemporary, -1);
+   uint32_t freeRegisters = (1u << registerCount) - 1;
+   vector<int> freeSpills;
+   vector<int> active;
+   int registersUsed = 0;
+   int spillSlots = 0;
+
+   for(int temporary : order) {
+      for(size_t i = 0; i < active.size();) {
+         int other = active[i];
+         if(end[other] > start[temporary]) {
+            i++;
+            continue;
+         }
+         if(this->assigned[other] < registerCount) {
+            freeRegisters |= 1u << this->assigned[other];
+         } else {
+            freeSpills.push_back(this->assigned[other]);
+         }
+         active[i] = active.back();
+         active.pop_back();
+      }
+
+      int location;
+      if(freeRegisters != 0) {
+         location = __builtin_ctz(freeRegisters);
+         freeRegisters &= freeRegisters - 1;
+      } else {
+         if(freeSpills.empty()) {
+            freeSpills.push_back(registerCount + spillSlots++);
+         }
+         location = freeSpills.back();
+         freeSpills.pop_back();
+         this->spills += this->output == nullptr;
+
+         int longest = -1;
+         for(int other : active) {
+            if(this->assigned[other] < registerCount && (longest < 0 || end[other] > end[longest])) {
+               longest = other;
+            }
+         }
+         if(longest >= 0 && end[longest] > end[temporary]) {
+            swap(location, this->assigned[longest]);
+         }
+      }
+      this->assigned[temporary] = location;
+      active.push_back(temporary);
+      registersUsed = max(registersUsed, min(location + 1, registerCount));
+   }
+
+   this->registerBase = base;
+   this->current->locals = base + (spillSlots > 0 ? registerCount + spillSlots : registersUsed);
+   if(this->current->locals > UINT16_MAX) {
+      sourceError(this->current->function->getOffset(), this->current->function->getLength(), "Too many variables, a function holds at most 65536!");
+   }
+}
+
+// Register instructions start with their destination slot, see instructions.txt
+void Emitter::encode() {
+   for(Instruction &instruction : this->code) {
+      if(instruction.isLabel) {
+         this->place(instruction.label);
+         continue;
+      }
+
+      vector<Operand> &operands = instruction.operands;
+      this->emit(instruction.opcode);
+      switch(instruction.opcode) {
+         case Opcode::Create:
+            this->put16(operands[0].index);
+            this->put8(instruction.count);
+            break;
+         case Opcode::Delete:
+            this->put16(operands[0].index);
+            break;
+         case Opcode::Jump:
+            this->putTarget(instruction.label);
+            break;
+         case Opcode::JumpUnlessRegister:
+            this->emitOperand(this->resolve(operands[0]).type, this->resolve(operands[0]).index);
+            this->putTarget(instruction.label);
+            break;
+         case Opcode::JumpUnlessEqualIntRegister:
+         case Opcode::JumpUnlessSmallerIntRegister:
+         case Opcode::JumpUnlessGreaterIntRegister:
+            this->emitOperand(this->resolve(operands[0]).type, this->resolve(operands[0]).index);
+            this->emitOperand(this->resolve(operands[1]).type, this->resolve(operands[1]).index);
+            this->putTarget(instruction.label);
+            break;
+         case Opcode::LoopInt:
+         case Opcode::NextInt:
+            this->put16(operands[0].index);
+            for(size_t i = 1; i < operands.size(); i++) {
+               this->emitOperand(this->resolve(operands[i]).type, this->resolve(operands[i]).index);
+            }
+            this->put8(instruction.count);
+            this->putTarget(instruction.label);
+            break;
+         case Opcode::ReturnRegister:
+         case Opcode::ExitRegister:
+            this->emitOperand(this->resolve(operands[0]).type, this->resolve(operands[0]).index);
+            break;
+         case Opcode::End:
+            break;
+         default:
+            this->put16(this->resolve(operands[0]).index);
+            if(instruction.opcode == Opcode::InvokeRegister) {
+               this->put8(instruction.count);
+               this->current->depth = max(this->current->depth, instruction.count);
+            } else if(instruction.opcode == Opcode::ArrayRegister) {
+               this->put16(instruction.count);
+            }
+            for(size_t i = 1; i < operands.size(); i++) {
+               this->emitOperand(this->resolve(operands[i]).type, this->resolve(operands[i]).index);
+            }
+            break;
+      }
+   }
+}
+
+Emitter::Operand Emitter::resolve(Operand operand) {
+   if(operand.temporary) {
+      return { PointerType::STACK, this->registerBase + this->assigned[operand.index], false };
+   }
+   return operand;
+}
+
+// Ints that fit into 16 bits are pushed as immediate operands and never reach the constants table
+void Emitter::emitConstant(Constant constant) {
+   this->emit(Opcode::Push);
+   this->emitConstantOperand(constant);
+}
+
+void Emitter::emitConstantOperand(Constant constant) {
+   if(constant.type == TypeCode::Int) {
+      int32_t value = 0;
+      for(int i = 0; i < 4; i++) {
+         value |= static_cast<uint8_t>(constant.data[i]) << (8 * i);
+      }
+      if(value >= INT16_MIN && value <= INT16_MAX) {
+         this->immediates += this->output == nullptr;
+         this->emitOperand(PointerType::IMMEDIATE, static_cast<uint16_t>(value));
+         return;
+      }
+   }
+
+   this->emitOperand(PointerType::CONSTANT, this->addConstant(constant));
+}
+
+// Equal literals (same type and bytes) share one constant. The measuring pass interns them and keeps the index of
+// every reference, the writing pass replays those indices in the same order.
+int Emitter::addConstant(Constant constant) {
+   if(this->output != nullptr) {
+      return this->constantReferences[this->nextConstant++];
+   }
+
+   string key(1, static_cast<char>(constant.type));
+   key += constant.data;
+   auto interned = this->constantPool.emplace(move(key), this->constants.size());
+   if(interned.second) {
+      if(this->constants.size() > UINT16_MAX) {
+         compilerError("Too many constants, at most 65536 can be referred to!");
+      }
+      this->constants.push_back(move(constant));
+   }
+   this->constantReferences.push_back(interned.first->second);
+   this->nextConstant++;
+   return interned.first->second;
+}
+
+void Emitter::emitSlot(Opcode opcode, int slot) {
+   this->emit(opcode);
+   this->put16(slot);
+}
+
+// Targets are offsets into the code of the function, forward targets are known from the measuring pass
+void Emitter::emitJump(Opcode opcode, int label) {
+   this->emit(opcode);
+   this->putTarget(label);
+}
+
+// An int compare right before is fused with the jump
+void Emitter::emitJumpUnless(int label) {
+   bool compared = this->lastOpcode == Opcode::EqualInt || this->lastOpcode == Opcode::SmallerInt || this->lastOpcode == Opcode::GreaterInt;
+   if(this->fuse && compared && this->lastPosition + 1 == this->position) {
+      Opcode opcode = static_cast<Opcode>(static_cast<int>(Opcode::JumpUnlessEqualInt) + static_cast<int>(this->lastOpcode) - static_cast<int>(Opcode::EqualInt));
+      this->position--;
+      this->instructions -= this->output == nullptr;
+      this->typedInstructions -= this->output == nullptr;
+      this->fused += this->output == nullptr;
+      this->emitJump(opcode, label);
+      return;
+   }
+   this->emitJump(Opcode::JumpUnless, label);
+}
+
+void Emitter::putTarget(int label) {
+   this->put32(this->output == nullptr ? 0 : this->current->labels[label]);
+}
+
+// Two pushes in a row become push2, the operand of the second one follows the first one
+void Emitter::emit(Opcode opcode) {
+   if(!this->registers) {
+      this->push(stackEffect(opcode));
+   }
+   if(this->fuse && opcode == Opcode::Push && this->lastOpcode == Opcode::Push && this->lastPosition + 4 == this->position) {
+      if(this->output != nullptr) {
+         this->output[this->lastPosition] = static_cast<char>(Opcode::PushTwo);
+      }
+      this->lastOpcode = Opcode::PushTwo;
+      this->fused += this->output == nullptr;
+      return;
+   }
+   this->instructions += this->output == nullptr;
+   this->typedInstructions += this->output == nullptr && opcode >= Opcode::AddInt && opcode <= Opcode::GreaterDoubleRegister;
+   this->lastOpcode = opcode;
+   this->lastPosition = this->position;
+   this->put8(static_cast<uint8_t>(opcode));
+}
+
+void Emitter::emitOperand(PointerType type, int index) {
+   this->put8(static_cast<uint8_t>(type));
+   this->put16(index);
+}
+
+// Follows the operands of the stack code, the deepest point is the depth of the function in the function table
+void Emitter::push(int count) {
+   this->depth += count;
+   this->current->depth = max(this->current->depth, this->depth);
+}
+
+int Emitter::newLabel() {
+   if(this->output == nullptr) {
+      this->current->labels.push_back(0);
+   }
+   return this->nextLabel++;
+}
+
+void Emitter::place(int label) {
+   if(this->output == nullptr) {
+      this->current->labels[label] = this->position - this->codeStart;
+   }
+   this->lastOpcode = Opcode::End; // nothing is fused across a jump target
+}
+
+// Slots of a block are reused once it ends
+void Emitter::enterScope() {
+   this->scopes.push_back({ this->locals.size(), this->nextSlot });
+}
+
+void Emitter::leaveScope() {
+   this->current->locals = max(this->current->locals, this->nextSlot);
+   while(this->locals.size() > this->scopes.back().first) {
+      if(!this->locals.back().deleted) {
+         this->unbind(this->locals.size() - 1);
+      }
+      this->locals.pop_back();
+   }
+   this->nextSlot = this->scopes.back().second;
+   this->scopes.pop_back();
+}
+
+// Every name maps to its innermost local, so lookups don't walk the locals of long scripts
+int Emitter::declare(const char *identifier, Statement *statement) {
+   int scopeStart = this->scopes.empty() ? 0 : this->scopes.back().first;
+   auto bound = identifier != nullptr ? this->bindings.find(identifier) : this->bindings.end();
+   if(bound != this->bindings.end() && bound->second >= scopeStart) {
+      sourceError(statement->getOffset(), statement->getLength(), "A variable with this name already exists in this block!");
+   }
+   if(this->nextSlot > UINT16_MAX) {
+      sourceError(statement->getOffset(), statement->getLength(), "Too many variables, a function holds at most 65536!");
+   }
+
+   this->locals.push_back({ identifier, this->nextSlot, bound != this->bindings.end() ? bound->second : -1, false, this->declarations++ });
+   if(identifier != nullptr) {
+      this->bindings[identifier] = this->locals.size() - 1;
+   }
+   return this->nextSlot++;
+}
+
+// The name refers to what it was before the local was declared
+void Emitter::unbind(int index) {
+   Local &local = this->locals[index];
+   local.deleted = true;
+   if(local.identifier == nullptr) {
+      return;
+   } else if(local.shadowed < 0) {
+      this->bindings.erase(local.identifier);
+   } else {
+      this->bindings[local.identifier] = local.shadowed;
+   }
+}
+
+// The innermost variable with the name, -1 if there is none
+int Emitter::findLocal(const char *identifier) {
+   auto bound = this->bindings.find(identifier);
+   return bound != this->bindings.end() ? this->locals[bound->second].slot : -1;
+}
+
+int Emitter::findLocal(const char *identifier, Statement *statement) {
+   int slot = this->findLocal(identifier);
+   if(slot < 0) {
+      sourceError(statement->getOffset(), statement->getLength(), "Unknown variable, it has to be created first!");
+   }
+   return slot;
+}
+
+int Emitter::findFunction(const char *identifier) {
+   auto function = this->functionNames.find(identifier);
+   return function != this->functionNames.end() ? function->second : -1;
+}
+
+void Emitter::put8(uint8_t value) {
+   if(this->output != nullptr) {
+      this->output[this->position] = static_cast<char>(value);
+   }
+   this->position++;
+}
+
+void Emitter::put16(uint16_t value) {
+   this->put8(value);
+   this->put8(value >> 8);
+}
+
+void Emitter::put32(uint32_t value) {
+   this->put16(value);
+   this->put16(value >> 16);
+}
+
+void Emitter::putBytes(const char *data, size_t length) {
+   if(this->output != nullptr) {
+      memcpy(&this->output[this->position], data, length);
+   }
+   this->position += length;
+}
+
+// A number of the header or the tables: width bytes, or 7 bits per byte with the high bit set on all but the last
+void Emitter::putField(uint64_t value, int width) {
+   if(!this->varints) {
+      for(int i = 0; i < width; i++) {
+         this->put8(value >> (8 * i));
+      }
+      return;
+   }
+   while(value >= 0x80) {
+      this->put8((value & 0x7F) | 0x80);
+      value >>= 7;
+   }
+   this->put8(value);
+}
+
+size_t Emitter::fieldSize(uint64_t value, int width) {
+   if(!this->varints) {
+      return width;
+   }
+   size_t size = 1;
+   for(; value >= 0x80; value >>= 7) {
+      size++;
+   }
+   return size;
+}
+
+/* util */
+
+// Keyword, BaseType or Identifier for a complete identifier run of the given length
+TokenType findKeyword(const char *text, int length) {
+   if(length < 2) {
+      return TokenType::Identifier;
+   }
+
+   const KeywordSlot &slot = keywordTable.slots[keywordHash(text, length)];
+   if(slot.length == length && memcmp(slot.word, text, length) == 0) {
+      return slot.type;
+   }
+   return TokenType::Identifier;
+}
+
+char* charcpy(const char *src, int length) {
+   char *copy = static_cast<char*>(arena->allocate(length + 1, 1));
+   memcpy(copy, src, length);
+   copy[length] = 0;
+   return copy;
+}
+
+// Reads the file into a single buffer, followed by zero bytes the tokenizer may look ahead into
+char* readFile(const char *filename, int *length) {
+   ifstream inputFile(filename, ios::binary);
+
+   if(!inputFile.is_open()){
+      cerr << "Unable to open file '" << filename << "' for reading" << endl;
+      exit(1);
+   }
+
+   inputFile.seekg(0, ios::end);
+   int size = inputFile.tellg();
+   inputFile.seekg(0, ios::beg);
+   char *inputContent;
+
+   if(size < 0) { // Pipes can't be measured upfront
+      inputFile.clear();
+      string piped((istreambuf_iterator<char>(inputFile)), istreambuf_iterator<char>());
+      size = piped.length();
+      inputContent = static_cast<char*>(arena->allocate(size + sourcePadding, 1));
+      memcpy(inputContent, piped.c_str(), size);
+   } else {
+      inputContent = static_cast<char*>(arena->allocate(size + sourcePadding, 1));
+      inputFile.read(inputContent, size);
+   }
+
+   memset(&inputContent[size], 0, sourcePadding);
+   *length = size;
+   return inputContent; 
+}
+
+// Maps the file read-only; the mapping is followed by at least one zero page, so the tokenizer may look ahead like with readFile
+const char* mapFile(const char *filename, int *length) {
+   int file = open(filename, O_RDONLY);
+   struct stat info;
+
+   if(file < 0 || fstat(file, &info) != 0) {
+      cerr << "Unable to open file '" << filename << "' for reading" << endl;
+      exit(1);
+   }
+
+   if(!S_ISREG(info.st_mode)) {
+      close(file);
+      useMmap = false;
+      return readFile(filename, length);
+   }
+
+   size_t mappedSize = info.st_size + sysconf(_SC_PAGESIZE);
+   char *content = static_cast<char*>(mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+   if(content == MAP_FAILED || (info.st_size > 0 && mmap(content, info.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, 0) == MAP_FAILED)) {
+      cerr << "Unable to map file '" << filename << "'" << endl;
+      exit(1);
+   }
+
+   madvise(content, info.st_size, MADV_SEQUENTIAL);
+   close(file);
+
+   *length = info.st_size;
+   return content;
+}
+
+void unmapFile(const char *content, int length) {
+   munmap(const_cast<char*>(content), length + sysconf(_SC_PAGESIZE));
+}
+
+// The bytecode is assembled in memory and written with a single call
+void writeFile(const char *data, size_t length, const char *filename) {
+   int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if(file < 0) {
+      cout << "Unable to open " << filename << " for writing, exiting!";
+      exit(-1);
+   }
+
+   size_t written = 0;
+   while(written < length) {
+      ssize_t count = write(file, data + written, length - written);
+      if(count < 0) {
+         cerr << "Unable to write " << filename << ", exiting!" << endl;
+         exit(-1);
+      }
+      written += count;
+   }
+   close(file);
+}
+
+// LZ4 style sequences over everything behind the flags (bytecode-specs.txt). A hash of the next 4 bytes remembers
+// where they were seen last, that position is the only match candidate
+vector<char> compressBytecode(const vector<char> &plain) {
+   vector<char> packed(plain.begin(), plain.begin() + 5);
+   packed[4] |= compressedSection;
+   const uint8_t *data = reinterpret_cast<const uint8_t*>(plain.data()) + 5;
+   size_t size = plain.size() - 5;
+
+   if(plain[4] & varintFields) {
+      for(size_t rest = size; ; rest >>= 7) {
+         packed.push_back(rest >= 0x80 ? (rest & 0x7F) | 0x80 : rest);
+         if(rest < 0x80) {
+            break;
+         }
+      }
+   } else {
+      for(int i = 0; i < 4; i++) {
+         packed.push_back(size >> (8 * i));
+      }
+   }
+
+   auto putLength = [&packed](size_t length) {
+      for(; length >= 255; length -= 255) {
+         packed.push_back(static_cast<char>(255));
+      }
+      packed.push_back(length);
+   };
+   auto putSequence = [&](size_t start, size_t literals, size_t match, size_t distance) {
+      size_t extra = match > 0 ? match - 4 : 0;
+      packed.push_back((min<size_t>(literals, 15) << 4) | min<size_t>(extra, 15));
+      if(literals >= 15) {
+         putLength(literals - 15);
+      }
+      if(extra >= 15) {
+         putLength(extra - 15);
+      }
+      packed.insert(packed.end(), data + start, data + start + literals);
+      if(match > 0) {
+         packed.push_back(distance);
+         packed.push_back(distance >> 8);
+      }
+   };
+
+   const int hashBits = 12;
+   vector<int> seen(1 << hashBits, -1);
+   auto hash = [data](size_t at) {
+      uint32_t bytes;
+      memcpy(&bytes, data + at, 4);
+      return (bytes * 2654435761u) >> (32 - hashBits);
+   };
+
+   size_t anchor = 0;
+   size_t at = 0;
+   while(at + 4 <= size) {
+      uint32_t slot = hash(at);
+      int candidate = seen[slot];
+      seen[slot] = at;
+      if(candidate < 0 || at - candidate > compressionWindow || memcmp(data + candidate, data + at, 4) != 0) {
+         at++;
+         continue;
+      }
+
+      size_t length = 4;
+      while(at + length < size && data[candidate + length] == data[at + length]) {
+         length++;
+      }
+      putSequence(anchor, at - anchor, length, at - candidate);
+      at += length;
+      anchor = at;
+   }
+   if(anchor < size) {
+      putSequence(anchor, size - anchor, 0, 0);
+   }
+   return packed;
+}
+
+// Internal errors, deferred like source errors while compiling on a worker thread
+void compilerError(const char *text) {
+   if(deferErrors) {
+      throw CompileError { -1, 0, text };
+   }
+   cerr << text << endl;
+   exit(1);
+}
+
+int hextoint(const char *text, int offset, int length) {
    int result = 0;
    int exp = 0;
    for(int i = length - 1 + offset; i >= offset; i--) {
@@ -2149,19 +6079,19 @@ int hextoint(char *text, int offset, int length) {
 }
 
 bool isAlphabetic(char c) {
-   return isUpper(c) || isLower(c);
+   return characterTable.classes[static_cast<unsigned char>(c)] & (classUpper | classLower);
 }
 
 bool isUpper(char c) {
-   return (c > 191 && c < 223 ) || (c >= 'A' && c <= 'Z'); 
+   return characterTable.classes[static_cast<unsigned char>(c)] & classUpper;
 }
 
 bool isLower(char c) {
-   return (c > 221 && c < 256) || (c >= 'a' && c <= 'z' );
+   return characterTable.classes[static_cast<unsigned char>(c)] & classLower;
 }
 
 bool isNumeric(char c) {
-   return c >= '0' && c <= '9';
+   return characterTable.classes[static_cast<unsigned char>(c)] & classDigit;
 }
 
 const char* getTokenTypeByInt(int num) {
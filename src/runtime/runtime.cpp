@@ -1,43 +1,232 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <stdexcept>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <type_traits>
+#include <unordered_map>
+#include <algorithm>
 
+// The bytecode file is mapped where the system has mmap, read into memory otherwise
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILES 1
+#else
+#define MAPPED_FILES 0
+#endif
+
+// With -DRTOS_COMPACT_ENTRIES an entry takes 9 bytes instead of 16: the value directly followed by the type byte,
+// without the padding. The value comes first, so that copies of whole entries line up with the stores of values.
+#ifdef RTOS_COMPACT_ENTRIES
+struct __attribute__((packed)) StackEntry {
+   long value; // Pointer or actual value
+   uint8_t info[1];
+};
+#else
 struct StackEntry {
    uint8_t info[4];
    long value; // Pointer or actual value
 };
+#endif
+
+// Entries of the tables in bytecode-specs.txt
+struct Constant {
+   uint8_t type;
+   std::string data;
+};
+
+// Opcodes of instructions.txt in the order of their numbers, types of bytecode-specs.txt
+#define OPCODES(X) \
+   X(Exit) X(Push) X(Pop) X(Create) X(Delete) X(Set) X(Add) X(Sub) X(Mul) X(Div) X(Equal) X(Smaller) X(Greater) \
+   X(And) X(Or) X(Not) X(Jump) X(JumpUnless) X(Invoke) X(Return) X(End) X(Array) X(Move) X(AddRegister) \
+   X(SubRegister) X(MulRegister) X(DivRegister) X(EqualRegister) X(SmallerRegister) X(GreaterRegister) \
+   X(AndRegister) X(OrRegister) X(NotRegister) X(JumpUnlessRegister) X(InvokeRegister) X(ReturnRegister) \
+   X(ExitRegister) X(ArrayRegister) X(AddInt) X(SubInt) X(MulInt) X(DivInt) X(EqualInt) X(SmallerInt) X(GreaterInt) \
+   X(AddLong) X(SubLong) X(MulLong) X(DivLong) X(EqualLong) X(SmallerLong) X(GreaterLong) X(AddFloat) X(SubFloat) \
+   X(MulFloat) X(DivFloat) X(EqualFloat) X(SmallerFloat) X(GreaterFloat) X(AddDouble) X(SubDouble) X(MulDouble) \
+   X(DivDouble) X(EqualDouble) X(SmallerDouble) X(GreaterDouble) X(AddIntRegister) X(SubIntRegister) \
+   X(MulIntRegister) X(DivIntRegister) X(EqualIntRegister) X(SmallerIntRegister) X(GreaterIntRegister) \
+   X(AddLongRegister) X(SubLongRegister) X(MulLongRegister) X(DivLongRegister) X(EqualLongRegister) \
+   X(SmallerLongRegister) X(GreaterLongRegister) X(AddFloatRegister) X(SubFloatRegister) X(MulFloatRegister) \
+   X(DivFloatRegister) X(EqualFloatRegister) X(SmallerFloatRegister) X(GreaterFloatRegister) X(AddDoubleRegister) \
+   X(SubDoubleRegister) X(MulDoubleRegister) X(DivDoubleRegister) X(EqualDoubleRegister) X(SmallerDoubleRegister) \
+   X(GreaterDoubleRegister) X(PushTwo) X(IncrementInt) X(DecrementInt) X(JumpUnlessEqualInt) X(JumpUnlessSmallerInt) \
+   X(JumpUnlessGreaterInt) X(JumpUnlessEqualIntRegister) X(JumpUnlessSmallerIntRegister) \
+   X(JumpUnlessGreaterIntRegister) X(LoopInt) X(NextInt)
+
+#define OPCODE_NAME(name) name,
+enum class Opcode : uint8_t {
+   OPCODES(OPCODE_NAME)
+};
+
+// Direct threading: every handler jumps to the handler of the next instruction through a table of label addresses
+// (computed goto of GCC and Clang). Other compilers, or a build with -DRTOS_SWITCH_DISPATCH, dispatch through
+// the switch once per instruction.
+#if !defined(RTOS_SWITCH_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
 
-const long stackSize = 1024 * 32;
-const char *bytecode;
+// GCC merges the equal ends of the handlers (the dispatch) into one otherwise, which undoes the threading
+#if THREADED_DISPATCH && !defined(__clang__)
+#define DISPATCH_LOOP __attribute__((optimize("no-crossjumping")))
+#else
+#define DISPATCH_LOOP
+#endif
+
+enum class TypeCode : uint8_t {
+   Bool, Byte, Char, Short, Int, Float, Double, Long, Void, Array, String, Function, Object
+};
 
-const StackEntry *stack;
+// An operand after pre-decoding: a slot of the frame or an entry of the literals of the function
+struct Operand {
+   uint32_t index : 31;
+   uint32_t local : 1;
+};
+
+// An instruction after pre-decoding, every one has the same size. Targets are indices of instructions, invoke.r
+// and array.r find their count operands at target in the operands of the function.
+struct Instruction {
+   void *handler; // threaded dispatch only
+   uint32_t target;
+   uint16_t slot; // slot, destination
+   Opcode opcode;
+   uint8_t mode; // type of create, mode of the counted loops
+   Operand operands[3];
+   uint16_t count; // arguments, elements
+   bool native; // invoke of a constant string
+};
+
+struct Function {
+   std::string name;
+   uint8_t parameters;
+   std::string parameterTypes;
+   uint16_t locals;
+   uint16_t depth; // entries above the locals: operands of the stack code, arguments of the register code
+   const uint8_t *code; // in the bytecode or the inflated code, not used once it is decoded
+   uint32_t size;
+   std::vector<uint8_t> inflatedCode; // released once it is decoded
+   std::vector<Instruction> instructions;
+   std::vector<StackEntry> literals;
+   std::vector<Operand> operands;
+};
+
+// Pointer types of the operands
+const uint8_t localOperand = 0x00;
+const uint8_t constantOperand = 0x03;
+const uint8_t functionOperand = 0x04;
+const uint8_t immediateOperand = 0x06;
+
+// Modes of the counted loops
+const uint8_t loopAbove = 0x01;
+const uint8_t loopDown = 0x02;
+
+// The stack grows in segments, deeper recursion than the limit is a stack overflow
+const size_t stackLimit = 1024 * 1024;
+const uint32_t bytecodeVersion = 4;
+const uint8_t varintFields = 0x01; // header flags
+const uint8_t compressedSection = 0x02;
+const uint8_t registerCode = 0x04;
+
+// The bytecode is read where it is, the code of the functions is decoded from there without copying it. The last
+// instruction of a function may be cut off, so padding zero bytes follow the bytecode and the inflated code.
+// A compressed section is inflated on the fly, the window keeps the last inflated bytes for the matches to copy
+// from, only the code of the functions is inflated as a whole.
+const size_t windowSize = 4096; // the compiler's compressionWindow
+const size_t codePadding = 16;
+
+const uint8_t *bytecode;
+uint64_t fileBytes;
+uint64_t position;
+#if MAPPED_FILES
+void *mapping;
+size_t mappingSize;
+#else
+std::vector<uint8_t> fileContent;
+#endif
+bool varints;
+bool registers;
+
+bool compressed;
+uint64_t inflatedSize;
+uint64_t inflated;
+uint8_t window[windowSize];
+size_t literalCount;
+size_t matchCount;
+size_t matchDistance;
+size_t nextMatch; // length of the match behind the literals, 0 if a new sequence starts
+
+std::vector<Constant> constants;
+std::vector<Function> functions;
+std::vector<StackEntry> constantEntries;
+std::deque<std::vector<StackEntry>> arrays; // kept until the program ends
+
+// A call of a function, the locals start at base. Stack code pushes its operands behind the locals, register
+// code has them in its locals and keeps the slot for the result of the call.
+struct Frame {
+   const Function *function;
+   uint32_t pc; // index of the next instruction
+   StackEntry *base;
+   StackEntry *top;
+   uint16_t destination;
+   uint32_t segment;
+};
+
+// The first segment holds the frame of function 0. A call whose frame doesn't fit anymore continues in the next
+// segment, segments stay allocated for the next recursion.
+std::vector<std::vector<StackEntry>> segments;
+size_t stackEntries;
 uint32_t counter;
+uint64_t dispatched;
+uint64_t decoded;
+
+// Profiling counts the sequences of two and three dispatched opcodes, the candidates for superinstructions
+bool profiling;
+uint32_t history;
+std::vector<uint64_t> bigrams;
+std::unordered_map<uint32_t, uint64_t> trigrams;
 
 
 void readInputFile(const char *filename);
+void loadBytecode(const uint8_t *bytes, uint64_t length);
+void closeInputFile();
+const uint8_t *skipBytes(size_t length);
+uint8_t readFileByte();
+uint8_t inflateByte();
+size_t readLength(size_t length);
+void readHeader();
+uint8_t readByte();
+uint64_t readField(int width);
+void readBytes(char *target, size_t length);
 void initStack();
+StackEntry *enterSegment(uint32_t segment, size_t frameSize);
 void initConstants();
 void initFunctions();
-void beginExecution();
+void initCode();
+Operand decodeOperand(Function &function, const uint8_t *code, uint32_t &pc);
+int beginExecution();
 
-void _add();
-void _sub();
-void _mul();
-void _div();
-
-void _grab();
-void _return();
-void _create();
-void _delete();
-void _set();
-
-void _equal();
-void _smaller();
-void _greater();
-
-void _cjmp();
-void _jmp();
-void _invoke();
+StackEntry entryOf(TypeCode type, long value);
+double realOf(const StackEntry &entry);
+StackEntry realEntry(TypeCode type, double value);
+inline const StackEntry& _operand(const Operand &operand, const StackEntry *base, const StackEntry *literals);
+StackEntry _convert(const StackEntry &entry, TypeCode type);
+StackEntry _arithmetic(Opcode opcode, const StackEntry &a, const StackEntry &b);
+StackEntry _compare(Opcode opcode, const StackEntry &a, const StackEntry &b);
+StackEntry _logic(Opcode opcode, const StackEntry &a, const StackEntry &b);
+StackEntry _array(const StackEntry *elements, int count);
+StackEntry _native(const std::string &name, const StackEntry *arguments, int count);
+void print(const StackEntry &entry);
+void profile(Opcode opcode);
+void printProfile(int count);
+std::string opcodeName(uint8_t opcode);
 
 
 int main(int argsCount, const char **args) {
@@ -46,35 +235,1275 @@ int main(int argsCount, const char **args) {
       return 1;
    }
 
-   // readInputFile(args[1]);
+   bool printStats = false;
+   profiling = false;
+   for(int i = 2; i < argsCount; i++) {
+      if(std::string(args[i]) == "--stats") {
+         printStats = true;
+      } else if(std::string(args[i]) == "--profile") {
+         profiling = true;
+      } else {
+         std::cerr << "Runtime Error: Unknown option " << args[i] << std::endl;
+         return 1;
+      }
+   }
+
+   try {
+      auto loadStart = std::chrono::steady_clock::now();
+      readInputFile(args[1]);
+      readHeader();
+      initConstants();
+      initFunctions();
+      initCode();
+      closeInputFile();
+      auto loadEnd = std::chrono::steady_clock::now();
+
+      if(printStats) {
+         double loadTime = std::chrono::duration<double, std::milli>(loadEnd - loadStart).count();
+         uint64_t bytecodeBytes = compressed ? 5 + inflated : fileBytes;
+         std::cout << "Load: " << fileBytes << " bytes" << (compressed ? " compressed" : "") << ", " << bytecodeBytes << " bytes of bytecode, " << decoded << " instructions decoded in " << loadTime << " ms (" << (bytecodeBytes / 1048576.0) / (loadTime / 1000.0) << " MB/s)" << std::endl;
+      }
+   } catch(const std::runtime_error &error) {
+      std::cerr << "Runtime Error: " << error.what() << std::endl;
+      return 1;
+   }
    initStack();
 
-   return 0;
+   int exitCode;
+   try {
+      auto runStart = std::chrono::steady_clock::now();
+      exitCode = beginExecution();
+      auto runEnd = std::chrono::steady_clock::now();
+
+      if(printStats) {
+         double runTime = std::chrono::duration<double, std::milli>(runEnd - runStart).count();
+         std::cout << "Run: " << dispatched << " instructions dispatched in " << runTime << " ms (" << (registers ? "register" : "stack") << " code, " << (THREADED_DISPATCH ? "threaded" : "switch") << " dispatch, " << (dispatched > 0 ? runTime * 1e6 / dispatched : 0) << " ns each)" << std::endl;
+         std::cout << "Stack: " << stackEntries << " entries in " << segments.size() << " segments of " << sizeof(StackEntry) << " bytes each (" << stackEntries * sizeof(StackEntry) / 1024.0 << " KB), " << sizeof(Instruction) << " bytes per instruction" << std::endl;
+      }
+      if(profiling) {
+         printProfile(10);
+      }
+   } catch(const std::runtime_error &error) {
+      std::cerr << "Runtime Error: " << error.what() << std::endl;
+      return 1;
+   }
+   return exitCode;
 }
 
 void readInputFile(const char* filename) {
-   std::ifstream file(filename, std::ios::binary);
+#if MAPPED_FILES
+   int file = open(filename, O_RDONLY);
+   struct stat info;
+   if(file < 0 || fstat(file, &info) != 0) {
+      if(file >= 0) {
+         close(file);
+      }
+      std::cerr << "Error opening file" << std::endl;
+      throw std::runtime_error("Error opening file!");
+   }
 
-   if (!file.is_open()) {
+   // Zero pages are reserved first and the file is mapped over their start, so the padding follows it
+   size_t pageSize = sysconf(_SC_PAGESIZE);
+   mappingSize = ((info.st_size + codePadding) / pageSize + 1) * pageSize;
+   mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   void *mapped = mapping;
+   if(mapping != MAP_FAILED && info.st_size > 0) {
+      mapped = mmap(mapping, info.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, 0);
+   }
+   close(file);
+   if(mapped == MAP_FAILED) {
+      if(mapping != MAP_FAILED) {
+         munmap(mapping, mappingSize);
+      }
+      mapping = nullptr;
+      throw std::runtime_error("Error mapping file!");
+   }
+   loadBytecode(static_cast<const uint8_t*>(mapped), info.st_size);
+#else
+   std::ifstream bytecodeFile(filename, std::ios::binary);
+   if (!bytecodeFile.is_open()) {
       std::cerr << "Error opening file" << std::endl;
       throw std::runtime_error("Error opening file!");
    }
+   fileContent.assign(std::istreambuf_iterator<char>(bytecodeFile), std::istreambuf_iterator<char>());
+   size_t length = fileContent.size();
+   fileContent.resize(length + codePadding);
+   loadBytecode(fileContent.data(), length);
+#endif
+}
+
+// Bytecode that is in memory already, in flash on targets without files. It is read without copying it, codePadding
+// zero bytes have to follow it.
+void loadBytecode(const uint8_t *bytes, uint64_t length) {
+   bytecode = bytes;
+   fileBytes = length;
+   position = 0;
+   compressed = false;
+   varints = false;
+   registers = false;
+}
+
+// The functions are decoded, nothing points into the bytecode anymore
+void closeInputFile() {
+#if MAPPED_FILES
+   if(mapping != nullptr) {
+      munmap(mapping, mappingSize);
+      mapping = nullptr;
+   }
+#else
+   std::vector<uint8_t>().swap(fileContent);
+#endif
+   bytecode = nullptr;
+}
+
+const uint8_t *skipBytes(size_t length) {
+   if(length > fileBytes - position) {
+      throw std::runtime_error("The bytecode file ends unexpectedly!");
+   }
+   const uint8_t *bytes = bytecode + position;
+   position += length;
+   return bytes;
+}
+
+uint8_t readFileByte() {
+   return *skipBytes(1);
+}
+
+// Sequences of the compressed section: a token holding the literal count (high 4 bits) and the match length - 4
+// (low 4 bits), the rest of both lengths if they are 15, the literals, then the 2 byte distance of the match
+uint8_t inflateByte() {
+   if(inflated == inflatedSize) {
+      throw std::runtime_error("The bytecode file ends unexpectedly!");
+   }
+
+   while(literalCount == 0 && matchCount == 0) {
+      if(nextMatch > 0) {
+         matchDistance = readFileByte();
+         matchDistance |= readFileByte() << 8;
+         if(matchDistance == 0 || matchDistance > windowSize || matchDistance > inflated) {
+            throw std::runtime_error("Invalid match in the compressed bytecode!");
+         }
+         matchCount = nextMatch;
+         nextMatch = 0;
+      } else {
+         uint8_t token = readFileByte();
+         literalCount = readLength(token >> 4);
+         nextMatch = readLength(token & 0x0F) + 4;
+      }
+   }
+
+   uint8_t byte;
+   if(literalCount > 0) {
+      literalCount--;
+      byte = readFileByte();
+   } else {
+      matchCount--;
+      byte = window[(inflated - matchDistance) % windowSize];
+   }
+   window[inflated % windowSize] = byte;
+   inflated++;
+   return byte;
+}
+
+// Lengths of 15 continue in the following bytes, up to the first one below 255
+size_t readLength(size_t length) {
+   if(length == 15) {
+      uint8_t more;
+      do {
+         more = readFileByte();
+         length += more;
+      } while(more == 255);
+   }
+   return length;
+}
+
+// The flags decide how the numbers of the header and the tables are read and if they are compressed
+void readHeader() {
+   char sequence[4];
+   for(int i = 0; i < 4; i++) {
+      sequence[i] = readFileByte();
+   }
+   if(memcmp(sequence, "rtos", 4) != 0) {
+      throw std::runtime_error("Not a bytecode file!");
+   }
+
+   uint8_t flags = readFileByte();
+   varints = (flags & varintFields) != 0;
+   registers = (flags & registerCode) != 0;
+   if(flags & compressedSection) {
+      inflatedSize = readField(4);
+      inflated = 0;
+      literalCount = 0;
+      matchCount = 0;
+      nextMatch = 0;
+      compressed = true;
+   }
+   if(readField(4) != bytecodeVersion) {
+      throw std::runtime_error("Unsupported bytecode version, recompile the script!");
+   }
+}
+
+uint8_t readByte() {
+   return compressed ? inflateByte() : readFileByte();
+}
+
+// A fixed size little endian number or a LEB128 varint, depending on the header flags
+uint64_t readField(int width) {
+   uint64_t value = 0;
+   if(!varints) {
+      for(int i = 0; i < width; i++) {
+         value |= static_cast<uint64_t>(readByte()) << (8 * i);
+      }
+      return value;
+   }
+
+   for(int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = readByte();
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if((byte & 0x80) == 0) {
+         return value;
+      }
+   }
+   throw std::runtime_error("Invalid number in the bytecode!");
+}
+
+void readBytes(char *target, size_t length) {
+   if(compressed) {
+      for(size_t i = 0; i < length; i++) {
+         target[i] = inflateByte();
+      }
+      return;
+   }
 
-   std::string fileContent((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-   file.close();
-   
-   bytecode = fileContent.c_str();
-   std::cout << "Read bytecode file!" << std::endl;
+   memcpy(target, skipBytes(length), length);
+}
+
+// The constants are decoded into stack entries once, strings point to their data
+void initConstants() {
+   uint64_t count = readField(4);
+   constants.clear();
+   for(uint64_t i = 0; i < count; i++) {
+      if(readField(8) != i) {
+         throw std::runtime_error("The constants are out of order!");
+      }
+      Constant constant;
+      constant.type = readByte();
+      constant.data.resize(readField(4));
+      readBytes(constant.data.data(), constant.data.length());
+      constants.push_back(std::move(constant));
+   }
+
+   constantEntries.clear();
+   for(const Constant &constant : constants) {
+      TypeCode type = static_cast<TypeCode>(constant.type);
+      if(type == TypeCode::String) {
+         constantEntries.push_back(entryOf(type, reinterpret_cast<long>(&constant.data)));
+         continue;
+      }
+
+      uint64_t bits = 0;
+      memcpy(&bits, constant.data.data(), std::min<size_t>(constant.data.length(), 8));
+      long value = bits;
+      if(type == TypeCode::Byte) {
+         value = static_cast<int8_t>(bits);
+      } else if(type == TypeCode::Short) {
+         value = static_cast<int16_t>(bits);
+      } else if(type == TypeCode::Int) {
+         value = static_cast<int32_t>(bits);
+      }
+      constantEntries.push_back(entryOf(type, value));
+   }
+}
+
+void initFunctions() {
+   uint64_t count = readField(4);
+   functions.clear();
+   for(uint64_t i = 0; i < count; i++) {
+      Function function;
+      function.name.resize(readByte());
+      readBytes(function.name.data(), function.name.length());
+      function.parameters = readByte();
+      function.parameterTypes.resize(function.parameters);
+      readBytes(function.parameterTypes.data(), function.parameters);
+      function.locals = readField(2);
+      function.depth = readField(2);
+      function.size = readField(4);
+      if(compressed) {
+         function.inflatedCode.resize(function.size + codePadding);
+         readBytes(reinterpret_cast<char*>(function.inflatedCode.data()), function.size);
+         function.code = function.inflatedCode.data();
+      } else {
+         function.code = skipBytes(function.size);
+      }
+      functions.push_back(std::move(function));
+   }
+   if(functions.empty()) {
+      throw std::runtime_error("The bytecode has no top level code!");
+   }
+   std::cout << "Loaded " << constants.size() << " constants and " << functions.size() << " functions!" << std::endl;
+}
+
+uint16_t read16(const uint8_t *code, uint32_t &pc) {
+   uint16_t value = code[pc] | code[pc + 1] << 8;
+   pc += 2;
+   return value;
+}
+
+uint32_t read32(const uint8_t *code, uint32_t &pc) {
+   uint32_t value = code[pc] | code[pc + 1] << 8 | code[pc + 2] << 16 | static_cast<uint32_t>(code[pc + 3]) << 24;
+   pc += 4;
+   return value;
+}
+
+// Pre-decoding: the code of every function becomes fixed size instructions once, the interpreter doesn't look at
+// the bytes of instructions.txt anymore. Jump targets are offsets into the code until all instructions are known.
+void initCode() {
+   decoded = 0;
+   for(Function &function : functions) {
+      uint32_t size = function.size;
+      const uint8_t *code = function.code; // a cut off last instruction reads the padding as its operands
+      std::vector<uint32_t> indices(size, UINT32_MAX);
+      std::vector<uint32_t> jumps;
+      function.instructions.clear();
+      function.literals.clear();
+      function.operands.clear();
+      function.instructions.reserve(size / 3); // an instruction takes about three bytes, a literal operand three more
+      function.literals.reserve(size / 6);
+
+      uint32_t pc = 0;
+      while(pc < size) {
+         indices[pc] = function.instructions.size();
+         Instruction instruction = {};
+         instruction.opcode = static_cast<Opcode>(code[pc++]);
+         switch(instruction.opcode) {
+            case Opcode::Push:
+            case Opcode::ReturnRegister:
+            case Opcode::ExitRegister:
+               instruction.operands[0] = decodeOperand(function, code, pc);
+               break;
+            case Opcode::PushTwo:
+               instruction.operands[0] = decodeOperand(function, code, pc);
+               instruction.operands[1] = decodeOperand(function, code, pc);
+               break;
+            case Opcode::Create:
+               instruction.slot = read16(code, pc);
+               instruction.mode = code[pc++];
+               break;
+            case Opcode::Delete:
+            case Opcode::Set:
+            case Opcode::IncrementInt:
+            case Opcode::DecrementInt:
+               instruction.slot = read16(code, pc);
+               break;
+            case Opcode::Array:
+               instruction.count = read16(code, pc);
+               break;
+            case Opcode::Jump:
+            case Opcode::JumpUnless:
+            case Opcode::JumpUnlessEqualInt:
+            case Opcode::JumpUnlessSmallerInt:
+            case Opcode::JumpUnlessGreaterInt:
+               instruction.target = read32(code, pc);
+               jumps.push_back(function.instructions.size());
+               break;
+            case Opcode::JumpUnlessRegister:
+               instruction.operands[0] = decodeOperand(function, code, pc);
+               instruction.target = read32(code, pc);
+               jumps.push_back(function.instructions.size());
+               break;
+            case Opcode::JumpUnlessEqualIntRegister:
+            case Opcode::JumpUnlessSmallerIntRegister:
+            case Opcode::JumpUnlessGreaterIntRegister:
+               instruction.operands[0] = decodeOperand(function, code, pc);
+               instruction.operands[1] = decodeOperand(function, code, pc);
+               instruction.target = read32(code, pc);
+               jumps.push_back(function.instructions.size());
+               break;
+            case Opcode::LoopInt:
+            case Opcode::NextInt:
+               instruction.slot = read16(code, pc);
+               instruction.operands[0] = decodeOperand(function, code, pc);
+               if(instruction.opcode == Opcode::NextInt) {
+                  instruction.operands[1] = decodeOperand(function, code, pc);
+               }
+               instruction.mode = code[pc++];
+               instruction.target = read32(code, pc);
+               jumps.push_back(function.instructions.size());
+               break;
+            case Opcode::Move:
+            case Opcode::NotRegister:
+               instruction.slot = read16(code, pc);
+               instruction.operands[0] = decodeOperand(function, code, pc);
+               break;
+            case Opcode::ArrayRegister:
+               instruction.slot = read16(code, pc);
+               instruction.count = read16(code, pc);
+               instruction.target = function.operands.size();
+               if(pc + 3 * instruction.count > size) {
+                  throw std::runtime_error("The code of a function ends within an instruction!");
+               }
+               for(uint16_t i = 0; i < instruction.count; i++) {
+                  function.operands.push_back(decodeOperand(function, code, pc));
+               }
+               break;
+            case Opcode::Invoke:
+            case Opcode::InvokeRegister:
+               if(instruction.opcode == Opcode::InvokeRegister) {
+                  instruction.slot = read16(code, pc);
+                  instruction.count = code[pc++];
+               }
+               instruction.native = code[pc] == constantOperand && code[pc + 1] + (code[pc + 2] << 8) < static_cast<int>(constantEntries.size()) && static_cast<TypeCode>(constantEntries[code[pc + 1] + (code[pc + 2] << 8)].info[0]) == TypeCode::String;
+               instruction.operands[0] = decodeOperand(function, code, pc);
+               if(instruction.opcode == Opcode::Invoke) {
+                  instruction.count = code[pc++];
+               } else {
+                  instruction.target = function.operands.size();
+                  if(pc + 3 * instruction.count > size) {
+                     throw std::runtime_error("The code of a function ends within an instruction!");
+                  }
+                  for(uint16_t i = 0; i < instruction.count; i++) {
+                     function.operands.push_back(decodeOperand(function, code, pc));
+                  }
+               }
+               break;
+            case Opcode::Exit: case Opcode::Pop: case Opcode::Return: case Opcode::End:
+            case Opcode::Add: case Opcode::Sub: case Opcode::Mul: case Opcode::Div:
+            case Opcode::Equal: case Opcode::Smaller: case Opcode::Greater: case Opcode::And: case Opcode::Or: case Opcode::Not:
+               break;
+            default:
+               if(instruction.opcode >= Opcode::AddInt && instruction.opcode <= Opcode::GreaterDouble) {
+                  break;
+               } else if(instruction.opcode >= Opcode::AddRegister && instruction.opcode <= Opcode::OrRegister) {
+                  instruction.slot = read16(code, pc);
+                  instruction.operands[0] = decodeOperand(function, code, pc);
+                  instruction.operands[1] = decodeOperand(function, code, pc);
+                  break;
+               } else if(instruction.opcode >= Opcode::AddIntRegister && instruction.opcode <= Opcode::GreaterDoubleRegister) {
+                  instruction.slot = read16(code, pc);
+                  instruction.operands[0] = decodeOperand(function, code, pc);
+                  instruction.operands[1] = decodeOperand(function, code, pc);
+                  break;
+               }
+               throw std::runtime_error("Unknown instruction " + std::to_string(static_cast<int>(instruction.opcode)) + "!");
+         }
+         if(pc > size) {
+            throw std::runtime_error("The code of a function ends within an instruction!");
+         }
+         function.instructions.push_back(instruction);
+      }
+
+      for(uint32_t jump : jumps) {
+         Instruction &instruction = function.instructions[jump];
+         if(instruction.target >= size || indices[instruction.target] == UINT32_MAX) {
+            throw std::runtime_error("Jump target is not an instruction!");
+         }
+         instruction.target = indices[instruction.target];
+      }
+      Opcode last = function.instructions.empty() ? Opcode::Push : function.instructions.back().opcode;
+      if(last != Opcode::End && last != Opcode::Return && last != Opcode::ReturnRegister && last != Opcode::Exit && last != Opcode::ExitRegister && last != Opcode::Jump) {
+         throw std::runtime_error("The code of a function runs past its end!");
+      }
+      decoded += function.instructions.size();
+      function.code = nullptr;
+      std::vector<uint8_t>().swap(function.inflatedCode);
+   }
+}
+
+// Literals are decoded into entries of the function, next to the ones of the instructions before
+Operand decodeOperand(Function &function, const uint8_t *code, uint32_t &pc) {
+   uint8_t type = code[pc++];
+   uint16_t index = read16(code, pc);
+   StackEntry entry;
+   switch(type) {
+      case localOperand:
+         return { index, 1 };
+      case constantOperand:
+         if(index >= constantEntries.size()) {
+            throw std::runtime_error("Unknown constant!");
+         }
+         entry = constantEntries[index];
+         break;
+      case functionOperand:
+         entry = entryOf(TypeCode::Function, index);
+         break;
+      case immediateOperand:
+         entry = entryOf(TypeCode::Int, static_cast<int16_t>(index));
+         break;
+      default:
+         throw std::runtime_error("Unknown operand type!");
+   }
+   function.literals.push_back(entry);
+   return { static_cast<uint32_t>(function.literals.size() - 1), 0 };
 }
 
 void initStack() {
-   stack = reinterpret_cast<StackEntry*>(
-	malloc(stackSize * sizeof(StackEntry))
-   );
+   segments.clear();
+   stackEntries = 0;
+   enterSegment(0, functions[0].locals + functions[0].depth);
    counter = 0;
    std::cout << "Stack initialized!" << std::endl;
 }
 
-void beginExecution() {
-   
+// The segment is allocated, or replaced by a larger one if the frame doesn't fit. Only the segments below it are in
+// use, each one is at least twice as large as the one before it.
+StackEntry *enterSegment(uint32_t segment, size_t frameSize) {
+   if(segment == segments.size()) {
+      segments.emplace_back();
+   }
+   std::vector<StackEntry> &entries = segments[segment];
+   if(entries.size() < frameSize) {
+      size_t size = std::max(frameSize, segment > 0 ? 2 * segments[segment - 1].size() : 0);
+      if(stackEntries - entries.size() + size > stackLimit) {
+         throw std::runtime_error("Stack overflow!");
+      }
+      stackEntries += size - entries.size();
+      entries = std::vector<StackEntry>(size);
+   }
+   return entries.data();
+}
+
+// Typed instructions know the types of their operands, the values are read without looking at the tags. Ints are
+// computed in 32 bits and longs in 64 bits, both wrap around.
+template<typename T> T typedValue(const StackEntry &entry) {
+   if constexpr(std::is_floating_point<T>::value) {
+      return realOf(entry);
+   } else {
+      return static_cast<T>(entry.value);
+   }
+}
+
+template<typename T> StackEntry typedEntry(T value) {
+   if constexpr(std::is_floating_point<T>::value) {
+      return realEntry(std::is_same<T, float>::value ? TypeCode::Float : TypeCode::Double, value);
+   } else {
+      return entryOf(std::is_same<T, int32_t>::value ? TypeCode::Int : TypeCode::Long, value);
+   }
+}
+
+template<typename T> StackEntry _add(const StackEntry &a, const StackEntry &b) {
+   if constexpr(std::is_integral<T>::value) {
+      return typedEntry<T>(static_cast<typename std::make_unsigned<T>::type>(typedValue<T>(a)) + static_cast<typename std::make_unsigned<T>::type>(typedValue<T>(b)));
+   } else {
+      return typedEntry<T>(typedValue<T>(a) + typedValue<T>(b));
+   }
+}
+
+template<typename T> StackEntry _sub(const StackEntry &a, const StackEntry &b) {
+   if constexpr(std::is_integral<T>::value) {
+      return typedEntry<T>(static_cast<typename std::make_unsigned<T>::type>(typedValue<T>(a)) - static_cast<typename std::make_unsigned<T>::type>(typedValue<T>(b)));
+   } else {
+      return typedEntry<T>(typedValue<T>(a) - typedValue<T>(b));
+   }
+}
+
+template<typename T> StackEntry _mul(const StackEntry &a, const StackEntry &b) {
+   if constexpr(std::is_integral<T>::value) {
+      return typedEntry<T>(static_cast<typename std::make_unsigned<T>::type>(typedValue<T>(a)) * static_cast<typename std::make_unsigned<T>::type>(typedValue<T>(b)));
+   } else {
+      return typedEntry<T>(typedValue<T>(a) * typedValue<T>(b));
+   }
+}
+
+template<typename T> StackEntry _div(const StackEntry &a, const StackEntry &b) {
+   T divisor = typedValue<T>(b);
+   if constexpr(std::is_integral<T>::value) {
+      if(divisor == 0) {
+         throw std::runtime_error("Division by zero!");
+      } else if(divisor == -1) { // the smallest number divided by -1 wraps around
+         return typedEntry<T>(0 - static_cast<typename std::make_unsigned<T>::type>(typedValue<T>(a)));
+      }
+   }
+   return typedEntry<T>(typedValue<T>(a) / divisor);
+}
+
+template<typename T> StackEntry _equal(const StackEntry &a, const StackEntry &b) {
+   return entryOf(TypeCode::Bool, typedValue<T>(a) == typedValue<T>(b));
+}
+
+template<typename T> StackEntry _smaller(const StackEntry &a, const StackEntry &b) {
+   return entryOf(TypeCode::Bool, typedValue<T>(a) < typedValue<T>(b));
+}
+
+template<typename T> StackEntry _greater(const StackEntry &a, const StackEntry &b) {
+   return entryOf(TypeCode::Bool, typedValue<T>(a) > typedValue<T>(b));
+}
+
+template<typename Operation> void stackOperation(StackEntry *&top, Operation operation) {
+   top--;
+   top[-1] = operation(top[-1], *top);
+}
+
+template<typename Operation> void registerOperation(const Instruction *instruction, StackEntry *base, const StackEntry *literals, Operation operation) {
+   base[instruction->slot] = operation(_operand(instruction->operands[0], base, literals), _operand(instruction->operands[1], base, literals));
+}
+
+// Runs function 0 until it ends or exits, both encodings of instructions.txt are executed by the same loop.
+// The exit code is returned.
+DISPATCH_LOOP int beginExecution() {
+   StackEntry *stack = segments[0].data();
+   const StackEntry *stackEnd = stack + segments[0].size();
+   std::vector<Frame> frames;
+   frames.push_back({ &functions[0], 0, stack, stack + functions[0].locals, 0, 0 });
+   for(StackEntry *local = stack; local < frames.back().top; local++) {
+      *local = entryOf(TypeCode::Void, 0);
+   }
+
+   Frame *frame = &frames.back();
+   const Instruction *code = frame->function->instructions.data();
+   const Instruction *ip = code;
+   const Instruction *instruction;
+   const StackEntry *literals = frame->function->literals.data();
+   StackEntry *base = frame->base;
+   StackEntry *top = frame->top;
+   dispatched = 0;
+   history = 0;
+   bigrams.assign(profiling ? 1 << 16 : 0, 0);
+   trigrams.clear();
+
+#if THREADED_DISPATCH
+#define CASE(name) case Opcode::name: handle##name
+#define DISPATCH() do { dispatched++; instruction = ip++; goto *instruction->handler; } while(0)
+#define HANDLER(name) &&handle##name,
+   // The handlers are bound to the decoded instructions once, profiling goes through one more handler
+   void *handlers[] = { OPCODES(HANDLER) };
+   for(Function &function : functions) {
+      for(Instruction &decoded : function.instructions) {
+         decoded.handler = profiling ? &&handleProfile : handlers[static_cast<uint8_t>(decoded.opcode)];
+      }
+   }
+#else
+#define CASE(name) case Opcode::name
+#define DISPATCH() continue
+#endif
+
+   // Dispatches through the switch at the start and after every return
+   while(true) {
+      dispatched++;
+      instruction = ip++;
+      StackEntry result;
+      if(profiling) {
+         profile(instruction->opcode);
+      }
+
+      switch(instruction->opcode) {
+         CASE(Push):
+            if(top == stackEnd) {
+               throw std::runtime_error("Stack overflow!");
+            }
+            *top++ = _operand(instruction->operands[0], base, literals);
+            DISPATCH();
+         CASE(Pop):
+            top--;
+            DISPATCH();
+         CASE(Create):
+            base[instruction->slot] = entryOf(static_cast<TypeCode>(instruction->mode), 0);
+            DISPATCH();
+         CASE(Delete):
+            base[instruction->slot] = entryOf(TypeCode::Void, 0);
+            DISPATCH();
+         CASE(Set):
+            base[instruction->slot] = *--top;
+            DISPATCH();
+         CASE(Add):
+         CASE(Sub):
+         CASE(Mul):
+         CASE(Div):
+            top--;
+            top[-1] = _arithmetic(instruction->opcode, top[-1], *top);
+            DISPATCH();
+         CASE(Equal):
+         CASE(Smaller):
+         CASE(Greater):
+            top--;
+            top[-1] = _compare(instruction->opcode, top[-1], *top);
+            DISPATCH();
+         CASE(And):
+         CASE(Or):
+            top--;
+            top[-1] = _logic(instruction->opcode, top[-1], *top);
+            DISPATCH();
+         CASE(Not):
+            top[-1] = _logic(instruction->opcode, top[-1], top[-1]);
+            DISPATCH();
+         CASE(Jump):
+            ip = code + instruction->target;
+            DISPATCH();
+         CASE(JumpUnless):
+            if((--top)->value == 0) {
+               ip = code + instruction->target;
+            }
+            DISPATCH();
+         CASE(Array):
+            top -= instruction->count;
+            *top = _array(top, instruction->count);
+            top++;
+            DISPATCH();
+
+         CASE(Move):
+            base[instruction->slot] = _operand(instruction->operands[0], base, literals);
+            DISPATCH();
+         CASE(AddRegister):
+         CASE(SubRegister):
+         CASE(MulRegister):
+         CASE(DivRegister):
+            base[instruction->slot] = _arithmetic(static_cast<Opcode>(static_cast<uint8_t>(instruction->opcode) - 0x11), _operand(instruction->operands[0], base, literals), _operand(instruction->operands[1], base, literals));
+            DISPATCH();
+         CASE(EqualRegister):
+         CASE(SmallerRegister):
+         CASE(GreaterRegister):
+            base[instruction->slot] = _compare(static_cast<Opcode>(static_cast<uint8_t>(instruction->opcode) - 0x11), _operand(instruction->operands[0], base, literals), _operand(instruction->operands[1], base, literals));
+            DISPATCH();
+         CASE(AndRegister):
+         CASE(OrRegister):
+         CASE(NotRegister): {
+            const StackEntry &a = _operand(instruction->operands[0], base, literals);
+            base[instruction->slot] = _logic(static_cast<Opcode>(static_cast<uint8_t>(instruction->opcode) - 0x11), a, instruction->opcode == Opcode::NotRegister ? a : _operand(instruction->operands[1], base, literals));
+            DISPATCH();
+         }
+
+         // Typed instructions, the operands have the type the compiler found for them
+         CASE(AddInt): stackOperation(top, _add<int32_t>); DISPATCH();
+         CASE(SubInt): stackOperation(top, _sub<int32_t>); DISPATCH();
+         CASE(MulInt): stackOperation(top, _mul<int32_t>); DISPATCH();
+         CASE(DivInt): stackOperation(top, _div<int32_t>); DISPATCH();
+         CASE(EqualInt): stackOperation(top, _equal<int32_t>); DISPATCH();
+         CASE(SmallerInt): stackOperation(top, _smaller<int32_t>); DISPATCH();
+         CASE(GreaterInt): stackOperation(top, _greater<int32_t>); DISPATCH();
+         CASE(AddLong): stackOperation(top, _add<long>); DISPATCH();
+         CASE(SubLong): stackOperation(top, _sub<long>); DISPATCH();
+         CASE(MulLong): stackOperation(top, _mul<long>); DISPATCH();
+         CASE(DivLong): stackOperation(top, _div<long>); DISPATCH();
+         CASE(EqualLong): stackOperation(top, _equal<long>); DISPATCH();
+         CASE(SmallerLong): stackOperation(top, _smaller<long>); DISPATCH();
+         CASE(GreaterLong): stackOperation(top, _greater<long>); DISPATCH();
+         CASE(AddFloat): stackOperation(top, _add<float>); DISPATCH();
+         CASE(SubFloat): stackOperation(top, _sub<float>); DISPATCH();
+         CASE(MulFloat): stackOperation(top, _mul<float>); DISPATCH();
+         CASE(DivFloat): stackOperation(top, _div<float>); DISPATCH();
+         CASE(EqualFloat): stackOperation(top, _equal<float>); DISPATCH();
+         CASE(SmallerFloat): stackOperation(top, _smaller<float>); DISPATCH();
+         CASE(GreaterFloat): stackOperation(top, _greater<float>); DISPATCH();
+         CASE(AddDouble): stackOperation(top, _add<double>); DISPATCH();
+         CASE(SubDouble): stackOperation(top, _sub<double>); DISPATCH();
+         CASE(MulDouble): stackOperation(top, _mul<double>); DISPATCH();
+         CASE(DivDouble): stackOperation(top, _div<double>); DISPATCH();
+         CASE(EqualDouble): stackOperation(top, _equal<double>); DISPATCH();
+         CASE(SmallerDouble): stackOperation(top, _smaller<double>); DISPATCH();
+         CASE(GreaterDouble): stackOperation(top, _greater<double>); DISPATCH();
+
+         CASE(AddIntRegister): registerOperation(instruction, base, literals, _add<int32_t>); DISPATCH();
+         CASE(SubIntRegister): registerOperation(instruction, base, literals, _sub<int32_t>); DISPATCH();
+         CASE(MulIntRegister): registerOperation(instruction, base, literals, _mul<int32_t>); DISPATCH();
+         CASE(DivIntRegister): registerOperation(instruction, base, literals, _div<int32_t>); DISPATCH();
+         CASE(EqualIntRegister): registerOperation(instruction, base, literals, _equal<int32_t>); DISPATCH();
+         CASE(SmallerIntRegister): registerOperation(instruction, base, literals, _smaller<int32_t>); DISPATCH();
+         CASE(GreaterIntRegister): registerOperation(instruction, base, literals, _greater<int32_t>); DISPATCH();
+         CASE(AddLongRegister): registerOperation(instruction, base, literals, _add<long>); DISPATCH();
+         CASE(SubLongRegister): registerOperation(instruction, base, literals, _sub<long>); DISPATCH();
+         CASE(MulLongRegister): registerOperation(instruction, base, literals, _mul<long>); DISPATCH();
+         CASE(DivLongRegister): registerOperation(instruction, base, literals, _div<long>); DISPATCH();
+         CASE(EqualLongRegister): registerOperation(instruction, base, literals, _equal<long>); DISPATCH();
+         CASE(SmallerLongRegister): registerOperation(instruction, base, literals, _smaller<long>); DISPATCH();
+         CASE(GreaterLongRegister): registerOperation(instruction, base, literals, _greater<long>); DISPATCH();
+         CASE(AddFloatRegister): registerOperation(instruction, base, literals, _add<float>); DISPATCH();
+         CASE(SubFloatRegister): registerOperation(instruction, base, literals, _sub<float>); DISPATCH();
+         CASE(MulFloatRegister): registerOperation(instruction, base, literals, _mul<float>); DISPATCH();
+         CASE(DivFloatRegister): registerOperation(instruction, base, literals, _div<float>); DISPATCH();
+         CASE(EqualFloatRegister): registerOperation(instruction, base, literals, _equal<float>); DISPATCH();
+         CASE(SmallerFloatRegister): registerOperation(instruction, base, literals, _smaller<float>); DISPATCH();
+         CASE(GreaterFloatRegister): registerOperation(instruction, base, literals, _greater<float>); DISPATCH();
+         CASE(AddDoubleRegister): registerOperation(instruction, base, literals, _add<double>); DISPATCH();
+         CASE(SubDoubleRegister): registerOperation(instruction, base, literals, _sub<double>); DISPATCH();
+         CASE(MulDoubleRegister): registerOperation(instruction, base, literals, _mul<double>); DISPATCH();
+         CASE(DivDoubleRegister): registerOperation(instruction, base, literals, _div<double>); DISPATCH();
+         CASE(EqualDoubleRegister): registerOperation(instruction, base, literals, _equal<double>); DISPATCH();
+         CASE(SmallerDoubleRegister): registerOperation(instruction, base, literals, _smaller<double>); DISPATCH();
+         CASE(GreaterDoubleRegister): registerOperation(instruction, base, literals, _greater<double>); DISPATCH();
+
+         // Superinstructions
+         CASE(PushTwo):
+            if(top + 2 > stackEnd) {
+               throw std::runtime_error("Stack overflow!");
+            }
+            top[0] = _operand(instruction->operands[0], base, literals);
+            top[1] = _operand(instruction->operands[1], base, literals);
+            top += 2;
+            DISPATCH();
+         CASE(IncrementInt):
+         CASE(DecrementInt): {
+            StackEntry &local = base[instruction->slot];
+            local = typedEntry<int32_t>(static_cast<uint32_t>(local.value) + (instruction->opcode == Opcode::IncrementInt ? 1u : -1u));
+            DISPATCH();
+         }
+         CASE(JumpUnlessEqualInt):
+         CASE(JumpUnlessSmallerInt):
+         CASE(JumpUnlessGreaterInt): {
+            top -= 2;
+            int32_t a = top[0].value;
+            int32_t b = top[1].value;
+            Opcode opcode = instruction->opcode;
+            if(!(opcode == Opcode::JumpUnlessEqualInt ? a == b : opcode == Opcode::JumpUnlessSmallerInt ? a < b : a > b)) {
+               ip = code + instruction->target;
+            }
+            DISPATCH();
+         }
+         CASE(JumpUnlessEqualIntRegister):
+         CASE(JumpUnlessSmallerIntRegister):
+         CASE(JumpUnlessGreaterIntRegister): {
+            int32_t a = _operand(instruction->operands[0], base, literals).value;
+            int32_t b = _operand(instruction->operands[1], base, literals).value;
+            Opcode opcode = instruction->opcode;
+            if(!(opcode == Opcode::JumpUnlessEqualIntRegister ? a == b : opcode == Opcode::JumpUnlessSmallerIntRegister ? a < b : a > b)) {
+               ip = code + instruction->target;
+            }
+            DISPATCH();
+         }
+
+         // Counted loops, the counter stays in its slot
+         CASE(LoopInt): {
+            int32_t counter = base[instruction->slot].value;
+            int32_t limit = _operand(instruction->operands[0], base, literals).value;
+            if(!(instruction->mode & loopAbove ? counter > limit : counter < limit)) {
+               ip = code + instruction->target;
+            }
+            DISPATCH();
+         }
+         CASE(NextInt): {
+            StackEntry &local = base[instruction->slot];
+            int32_t limit = _operand(instruction->operands[0], base, literals).value;
+            uint32_t step = _operand(instruction->operands[1], base, literals).value;
+            int32_t counter = static_cast<int32_t>(static_cast<uint32_t>(local.value) + (instruction->mode & loopDown ? -step : step));
+            local = typedEntry<int32_t>(counter);
+            if(instruction->mode & loopAbove ? counter > limit : counter < limit) {
+               ip = code + instruction->target;
+            }
+            DISPATCH();
+         }
+
+         CASE(JumpUnlessRegister):
+            if(_operand(instruction->operands[0], base, literals).value == 0) {
+               ip = code + instruction->target;
+            }
+            DISPATCH();
+         CASE(ArrayRegister): {
+            const Operand *operands = frame->function->operands.data() + instruction->target;
+            std::vector<StackEntry> elements(instruction->count);
+            for(uint16_t i = 0; i < instruction->count; i++) {
+               elements[i] = _operand(operands[i], base, literals);
+            }
+            base[instruction->slot] = _array(elements.data(), instruction->count);
+            DISPATCH();
+         }
+
+         // Calls: stack code passes the topmost entries, which become the first locals of the new frame. Register
+         // code copies its argument operands behind its own locals.
+         CASE(Invoke):
+         CASE(InvokeRegister): {
+            bool registerCall = instruction->opcode == Opcode::InvokeRegister;
+            uint16_t destination = registerCall ? instruction->slot : 0;
+            uint16_t count = instruction->count;
+            StackEntry function = _operand(instruction->operands[0], base, literals);
+
+            StackEntry *arguments = top - count;
+            if(registerCall) {
+               const Operand *operands = frame->function->operands.data() + instruction->target;
+               arguments = base + frame->function->locals;
+               if(arguments + count > stackEnd) {
+                  throw std::runtime_error("Stack overflow!");
+               }
+               for(uint16_t i = 0; i < count; i++) {
+                  arguments[i] = _operand(operands[i], base, literals);
+               }
+            } else if(arguments == stackEnd) {
+               throw std::runtime_error("Stack overflow!");
+            }
+            if(instruction->native) {
+               result = _native(*reinterpret_cast<const std::string*>(function.value), arguments, count);
+               if(registerCall) {
+                  base[destination] = result;
+               } else {
+                  *arguments = result;
+                  top = arguments + 1;
+               }
+               DISPATCH();
+            }
+            if(static_cast<TypeCode>(function.info[0]) != TypeCode::Function || static_cast<size_t>(function.value) >= functions.size()) {
+               throw std::runtime_error("Invoked value is not a function!");
+            }
+
+            const Function *callee = &functions[function.value];
+            if(count != callee->parameters) {
+               throw std::runtime_error("Wrong number of arguments for " + (callee->name.empty() ? std::string("a lambda") : callee->name) + "!");
+            }
+            // A frame that doesn't fit into the segment anymore continues in the next one, the arguments move along
+            uint32_t segment = frame->segment;
+            if(arguments + callee->locals + callee->depth > stackEnd) {
+               segment++;
+               StackEntry *moved = enterSegment(segment, callee->locals + callee->depth);
+               std::copy(arguments, arguments + count, moved);
+               arguments = moved;
+               stackEnd = moved + segments[segment].size();
+            }
+            for(uint16_t i = 0; i < count; i++) {
+               TypeCode type = static_cast<TypeCode>(callee->parameterTypes[i]);
+               if(static_cast<TypeCode>(arguments[i].info[0]) != type) {
+                  arguments[i] = _convert(arguments[i], type);
+               }
+            }
+            for(StackEntry *local = arguments + count; local < arguments + callee->locals; local++) {
+               *local = entryOf(TypeCode::Void, 0);
+            }
+
+            frame->pc = ip - code;
+            frame->top = top;
+            frames.push_back({ callee, 0, arguments, arguments + callee->locals, destination, segment });
+            frame = &frames.back();
+            code = callee->instructions.data();
+            ip = code;
+            literals = callee->literals.data();
+            base = frame->base;
+            top = frame->top;
+            DISPATCH();
+         }
+
+         CASE(Exit):
+            return static_cast<int>((--top)->value);
+         CASE(ExitRegister):
+            return static_cast<int>(_operand(instruction->operands[0], base, literals).value);
+         CASE(Return):
+            result = *--top;
+            break;
+         CASE(ReturnRegister):
+            result = _operand(instruction->operands[0], base, literals);
+            break;
+         CASE(End):
+            result = entryOf(TypeCode::Void, 0);
+            break;
+#if THREADED_DISPATCH
+         handleProfile:
+            profile(instruction->opcode);
+            goto *handlers[static_cast<uint8_t>(instruction->opcode)];
+#endif
+         default:
+            throw std::runtime_error("Unknown instruction " + std::to_string(static_cast<int>(instruction->opcode)) + "!");
+      }
+
+      // Return, the result goes where the arguments were (stack code) or into the destination (register code)
+      uint16_t destination = frame->destination;
+      uint32_t segment = frame->segment;
+      uint8_t parameters = frame->function->parameters;
+      frames.pop_back();
+      if(frames.empty()) {
+         return 0;
+      }
+      frame = &frames.back();
+      code = frame->function->instructions.data();
+      ip = code + frame->pc;
+      literals = frame->function->literals.data();
+      base = frame->base;
+      if(frame->segment != segment) {
+         stackEnd = segments[frame->segment].data() + segments[frame->segment].size();
+      }
+      if(registers) {
+         base[destination] = result;
+         top = frame->top;
+      } else {
+         StackEntry *arguments = frame->top - parameters;
+         *arguments = result;
+         top = arguments + 1;
+      }
+   }
+}
+
+#undef CASE
+#undef DISPATCH
+#undef HANDLER
+
+StackEntry entryOf(TypeCode type, long value) {
+   StackEntry entry;
+   entry.info[0] = static_cast<uint8_t>(type);
+   entry.value = value;
+   return entry;
+}
+
+inline const StackEntry& _operand(const Operand &operand, const StackEntry *base, const StackEntry *literals) {
+   return operand.local ? base[operand.index] : literals[operand.index];
+}
+
+bool isNumber(TypeCode type) {
+   return type >= TypeCode::Byte && type <= TypeCode::Long;
+}
+
+// Arguments get the declared types of the parameters, numbers are converted, a bool has to be a bool
+StackEntry _convert(const StackEntry &entry, TypeCode type) {
+   TypeCode from = static_cast<TypeCode>(entry.info[0]);
+   if(type == TypeCode::Bool) {
+      throw std::runtime_error("Expected a bool argument!");
+   } else if(!isNumber(type)) {
+      return entry;
+   } else if(!isNumber(from)) {
+      throw std::runtime_error("Expected a number argument!");
+   }
+
+   if(type == TypeCode::Float || type == TypeCode::Double) {
+      return realEntry(type, realOf(entry));
+   }
+   long value = from == TypeCode::Float || from == TypeCode::Double ? static_cast<long>(realOf(entry)) : entry.value;
+   switch(type) {
+      case TypeCode::Byte: return entryOf(type, static_cast<int8_t>(value));
+      case TypeCode::Char: return entryOf(type, static_cast<uint16_t>(value));
+      case TypeCode::Short: return entryOf(type, static_cast<int16_t>(value));
+      case TypeCode::Int: return entryOf(type, static_cast<int32_t>(value));
+      default: return entryOf(type, value);
+   }
+}
+
+// The wider of both types like in the compiler, byte, char and short compute as int
+TypeCode promote(TypeCode a, TypeCode b) {
+   auto rank = [](TypeCode type) {
+      switch(type) {
+         case TypeCode::Long: return 1;
+         case TypeCode::Float: return 2;
+         case TypeCode::Double: return 3;
+         default: return 0;
+      }
+   };
+   if(!isNumber(a) || !isNumber(b)) {
+      throw std::runtime_error("Operands must be numbers!");
+   }
+   int wider = std::max(rank(a), rank(b));
+   return wider == 3 ? TypeCode::Double : wider == 2 ? TypeCode::Float : wider == 1 ? TypeCode::Long : TypeCode::Int;
+}
+
+double realOf(const StackEntry &entry) {
+   TypeCode type = static_cast<TypeCode>(entry.info[0]);
+   if(type == TypeCode::Float) {
+      float value;
+      uint32_t bits = entry.value;
+      memcpy(&value, &bits, 4);
+      return value;
+   } else if(type == TypeCode::Double) {
+      double value;
+      long bits = entry.value;
+      memcpy(&value, &bits, 8);
+      return value;
+   }
+   return entry.value;
+}
+
+StackEntry realEntry(TypeCode type, double value) {
+   long bits = 0;
+   if(type == TypeCode::Float) {
+      float single = value;
+      uint32_t singleBits;
+      memcpy(&singleBits, &single, 4);
+      bits = singleBits;
+   } else {
+      memcpy(&bits, &value, 8);
+   }
+   return entryOf(type, bits);
+}
+
+// Integers wrap around, int in 32 and long in 64 bits
+StackEntry _arithmetic(Opcode opcode, const StackEntry &a, const StackEntry &b) {
+   TypeCode type = promote(static_cast<TypeCode>(a.info[0]), static_cast<TypeCode>(b.info[0]));
+   if(type == TypeCode::Float || type == TypeCode::Double) {
+      double x = realOf(a);
+      double y = realOf(b);
+      if(type == TypeCode::Float) {
+         float first = x;
+         float second = y;
+         switch(opcode) {
+            case Opcode::Add: return realEntry(type, first + second);
+            case Opcode::Sub: return realEntry(type, first - second);
+            case Opcode::Mul: return realEntry(type, first * second);
+            default: return realEntry(type, first / second);
+         }
+      }
+      switch(opcode) {
+         case Opcode::Add: return realEntry(type, x + y);
+         case Opcode::Sub: return realEntry(type, x - y);
+         case Opcode::Mul: return realEntry(type, x * y);
+         default: return realEntry(type, x / y);
+      }
+   }
+
+   uint64_t x = a.value;
+   uint64_t y = b.value;
+   uint64_t value;
+   switch(opcode) {
+      case Opcode::Add: value = x + y; break;
+      case Opcode::Sub: value = x - y; break;
+      case Opcode::Mul: value = x * y; break;
+      default:
+         if(y == 0) {
+            throw std::runtime_error("Division by zero!");
+         }
+         return type == TypeCode::Int ? _div<int32_t>(a, b) : _div<long>(a, b);
+   }
+   return entryOf(type, type == TypeCode::Int ? static_cast<int32_t>(value) : static_cast<long>(value));
+}
+
+StackEntry _compare(Opcode opcode, const StackEntry &a, const StackEntry &b) {
+   TypeCode first = static_cast<TypeCode>(a.info[0]);
+   TypeCode second = static_cast<TypeCode>(b.info[0]);
+   if(opcode == Opcode::Equal && (!isNumber(first) || !isNumber(second))) {
+      if(first == TypeCode::String && second == TypeCode::String) {
+         return entryOf(TypeCode::Bool, *reinterpret_cast<const std::string*>(a.value) == *reinterpret_cast<const std::string*>(b.value));
+      }
+      return entryOf(TypeCode::Bool, first == second && a.value == b.value);
+   }
+
+   TypeCode type = promote(first, second);
+   if(type == TypeCode::Float || type == TypeCode::Double) {
+      double x = realOf(a);
+      double y = realOf(b);
+      return entryOf(TypeCode::Bool, opcode == Opcode::Equal ? x == y : opcode == Opcode::Smaller ? x < y : x > y);
+   }
+   long x = type == TypeCode::Int ? static_cast<int32_t>(a.value) : a.value;
+   long y = type == TypeCode::Int ? static_cast<int32_t>(b.value) : b.value;
+   return entryOf(TypeCode::Bool, opcode == Opcode::Equal ? x == y : opcode == Opcode::Smaller ? x < y : x > y);
+}
+
+StackEntry _logic(Opcode opcode, const StackEntry &a, const StackEntry &b) {
+   if(static_cast<TypeCode>(a.info[0]) != TypeCode::Bool || static_cast<TypeCode>(b.info[0]) != TypeCode::Bool) {
+      throw std::runtime_error("Operands of a logic instruction must be bools!");
+   }
+   switch(opcode) {
+      case Opcode::And: return entryOf(TypeCode::Bool, a.value && b.value);
+      case Opcode::Or: return entryOf(TypeCode::Bool, a.value || b.value);
+      default: return entryOf(TypeCode::Bool, !a.value);
+   }
+}
+
+StackEntry _array(const StackEntry *elements, int count) {
+   arrays.emplace_back(elements, elements + count);
+   return entryOf(TypeCode::Array, reinterpret_cast<long>(&arrays.back()));
+}
+
+// Functions of the runtime, invoked through a constant naming them
+StackEntry _native(const std::string &name, const StackEntry *arguments, int count) {
+   if(name == "system::print" || name == "env::print") {
+      for(int i = 0; i < count; i++) {
+         print(arguments[i]);
+         std::cout << (i + 1 < count ? " " : "");
+      }
+      std::cout << std::endl;
+      return entryOf(TypeCode::Void, 0);
+   } else if(name == "util::freeRam") {
+      return entryOf(TypeCode::Long, (stackLimit - stackEntries) * sizeof(StackEntry));
+   }
+   throw std::runtime_error("Unknown native function " + name + "!");
+}
+
+void print(const StackEntry &entry) {
+   switch(static_cast<TypeCode>(entry.info[0])) {
+      case TypeCode::Bool:
+         std::cout << (entry.value ? "true" : "false");
+         break;
+      case TypeCode::Char: {
+         uint16_t character = entry.value;
+         if(character < 0x80) {
+            std::cout << static_cast<char>(character);
+         } else if(character < 0x800) {
+            std::cout << static_cast<char>(0xC0 | character >> 6) << static_cast<char>(0x80 | (character & 0x3F));
+         } else {
+            std::cout << static_cast<char>(0xE0 | character >> 12) << static_cast<char>(0x80 | (character >> 6 & 0x3F)) << static_cast<char>(0x80 | (character & 0x3F));
+         }
+         break;
+      }
+      case TypeCode::Float:
+      case TypeCode::Double:
+         std::cout << realOf(entry);
+         break;
+      case TypeCode::Void:
+         std::cout << "void";
+         break;
+      case TypeCode::Array: {
+         const std::vector<StackEntry> *elements = reinterpret_cast<const std::vector<StackEntry>*>(entry.value);
+         std::cout << "[";
+         for(size_t i = 0; elements != nullptr && i < elements->size(); i++) {
+            std::cout << (i > 0 ? ", " : "");
+            print((*elements)[i]);
+         }
+         std::cout << "]";
+         break;
+      }
+      case TypeCode::String:
+         std::cout << *reinterpret_cast<const std::string*>(entry.value);
+         break;
+      case TypeCode::Function:
+         std::cout << "function " << entry.value;
+         break;
+      case TypeCode::Object:
+         std::cout << "object";
+         break;
+      default:
+         std::cout << entry.value;
+         break;
+   }
+}
+
+void profile(Opcode opcode) {
+   history = (history << 8 | static_cast<uint8_t>(opcode)) & 0xFFFFFF;
+   if(dispatched >= 2) {
+      bigrams[history & 0xFFFF]++;
+   }
+   if(dispatched >= 3) {
+      trigrams[history]++;
+   }
+}
+
+// The most frequent sequences with their share of the dispatched instructions
+void printProfile(int count) {
+   std::vector<std::pair<uint64_t, uint32_t>> sequences;
+   for(uint32_t i = 0; i < bigrams.size(); i++) {
+      if(bigrams[i] > 0) {
+         sequences.push_back({ bigrams[i], i });
+      }
+   }
+   for(int length = 2; length <= 3; length++) {
+      if(length == 3) {
+         sequences.clear();
+         for(auto &trigram : trigrams) {
+            sequences.push_back({ trigram.second, trigram.first });
+         }
+      }
+      std::sort(sequences.begin(), sequences.end(), std::greater<std::pair<uint64_t, uint32_t>>());
+
+      std::cout << "Profile: " << (length == 2 ? "bigrams" : "trigrams") << std::endl;
+      for(int i = 0; i < count && i < static_cast<int>(sequences.size()); i++) {
+         std::string names;
+         for(int shift = 8 * (length - 1); shift >= 0; shift -= 8) {
+            names += opcodeName(sequences[i].second >> shift & 0xFF) + (shift > 0 ? " " : "");
+         }
+         std::cout << "   " << names << ": " << sequences[i].first << " (" << 100.0 * sequences[i].first / dispatched << "%)" << std::endl;
+      }
+   }
+}
+
+// Names of instructions.txt
+std::string opcodeName(uint8_t opcode) {
+   static const char *names[] = {
+      "exit", "push", "pop", "create", "delete", "set", "add", "sub", "mul", "div", "equal", "smaller", "greater", "and",
+      "or", "not", "jmp", "cjmp", "invoke", "return", "end", "array", "mov", "add.r", "sub.r", "mul.r", "div.r",
+      "equal.r", "smaller.r", "greater.r", "and.r", "or.r", "not.r", "cjmp.r", "invoke.r", "return.r", "exit.r", "array.r"
+   };
+   static const char *typedNames[] = { "add", "sub", "mul", "div", "equal", "smaller", "greater" };
+   static const char *types[] = { "i32", "i64", "f32", "f64" };
+   static const char *superNames[] = {
+      "push2", "inc.i32", "dec.i32", "cjmp.equal.i32", "cjmp.smaller.i32", "cjmp.greater.i32", "cjmp.equal.i32.r",
+      "cjmp.smaller.i32.r", "cjmp.greater.i32.r", "loop.i32", "next.i32"
+   };
+
+   if(opcode < sizeof(names) / sizeof(names[0])) {
+      return names[opcode];
+   }
+   int typed = opcode - static_cast<int>(Opcode::AddInt);
+   if(typed < 56) {
+      return std::string(typedNames[typed % 7]) + "." + types[typed / 7 % 4] + (typed >= 28 ? ".r" : "");
+   } else if(typed < 67) {
+      return superNames[typed - 56];
+   }
+   return "0x" + std::to_string(opcode);
 }